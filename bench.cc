@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <queue>
+#include <vector>
+#include <unordered_map>
+#include "gcptr.h"
+#include "gcqueue.h"
+#include "gcmap.h"
+
+using namespace std;
+using namespace gcptr;
+
+// Benchmarks of the garbage-collected concurrent containers against a mutex-protected
+// standard container and, for the queue, a Michael & Scott queue with epoch-based
+// reclamation, of allocation, of local roots with and without a root scope, of the
+// worst-case pause of allocations in the default and real-time collection modes, of
+// traversals before and after compact(), of the placement of nested allocations, and of
+// process exit with and without fast exit. Benchmarks of heap settings that must precede any
+// allocation run first, each in a child process.
+// Usage: bench [threads [operations per thread [regions]]], where 'regions' selects the
+// mark-region heap engine.
+
+unsigned nthr = 4;
+unsigned nops = 200000;
+
+// Run body(thread index) on nthr threads and print the elapsed time.
+template <typename F> void run(const char *name, F body)
+{
+	auto start = chrono::high_resolution_clock::now();
+	vector<thread> th;
+	for ( unsigned i = 0 ; i < nthr ; i++ )
+		th.push_back(thread(body, i));
+	for ( auto &t : th )
+		t.join();
+	auto usec = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+	printf("%-24s %8.1f ms %8.1f ns/op\n", name, usec / 1000.0, usec * 1000.0 / (nthr * nops));
+}
+
+// Run body() in a child process, which has allocated nothing yet.
+template <typename F> void in_child(F body)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if ( !pid )
+	{
+		body();
+		fflush(stdout);
+		_exit(0);
+	}
+	waitpid(pid, nullptr, 0);
+}
+
+/////////////////////////////
+// Mutex-based equivalents //
+/////////////////////////////
+
+template <typename T> class mutex_queue
+{
+	public:
+
+		void push(const T &val)
+		{
+			lock_guard<mutex> lg(m);
+			q.push(val);
+		}
+
+		bool pop(T &val)
+		{
+			lock_guard<mutex> lg(m);
+			if ( q.empty() )
+				return false;
+			val = q.front();
+			q.pop();
+			return true;
+		}
+
+	private:
+
+		mutex m;
+		queue<T> q;
+};
+
+template <typename K, typename V> class mutex_map
+{
+	public:
+
+		bool find(const K &key, V &val)
+		{
+			lock_guard<mutex> lg(m);
+			auto i = map.find(key);
+			if ( i == map.end() )
+				return false;
+			val = i->second;
+			return true;
+		}
+
+		bool insert(const K &key, const V &val)
+		{
+			lock_guard<mutex> lg(m);
+			bool found = map.count(key);
+			map[key] = val;
+			return !found;
+		}
+
+	private:
+
+		mutex m;
+		unordered_map<K, V> map;
+};
+
+////////////////////////////////////////
+// Queue with epoch-based reclamation //
+////////////////////////////////////////
+
+namespace ebr
+{
+	const unsigned max_threads = 64;
+
+	// Thread state: announced epoch (2 * epoch + 1 while in a critical section, 0 outside)
+	// and retired nodes for the last 3 epochs.
+	struct thread_state
+	{
+		atomic<unsigned> local;
+		unsigned seen;
+		vector<void (*)(void *)> dtor[3];
+		vector<void *> limbo[3];
+	};
+
+	atomic<unsigned> epoch;
+	atomic<unsigned> nthreads;
+	thread_state *threads[max_threads];
+	__thread thread_state *self;
+
+	// Free the nodes retired 3 epochs ago
+	void reclaim(unsigned slot)
+	{
+		for ( unsigned i = 0 ; i < self->limbo[slot].size() ; i++ )
+			self->dtor[slot][i](self->limbo[slot][i]);
+		self->limbo[slot].clear();
+		self->dtor[slot].clear();
+	}
+
+	void enter()
+	{
+		if ( !self )
+		{
+			self = new thread_state();
+			self->local = 0;
+			self->seen = epoch;
+			threads[nthreads++] = self;
+		}
+		unsigned e = epoch;
+		if ( e != self->seen )
+		{
+			reclaim(e % 3);
+			self->seen = e;
+		}
+		self->local = 2 * e + 1;
+	}
+
+	void exit() { self->local = 0; }
+
+	// Advance the epoch if all threads in a critical section have seen the current one
+	void advance()
+	{
+		unsigned e = epoch;
+		for ( unsigned i = 0 ; i < nthreads ; i++ )
+		{
+			unsigned l = threads[i]->local;
+			if ( l && l != 2 * e + 1 )
+				return;
+		}
+		epoch.compare_exchange_strong(e, e + 1);
+	}
+
+	template <typename T> void retire(T *p)
+	{
+		unsigned slot = self->seen % 3;
+		self->limbo[slot].push_back(p);
+		self->dtor[slot].push_back([](void *q) { delete static_cast<T *>(q); });
+		if ( self->limbo[slot].size() % 64 == 0 )
+			advance();
+	}
+
+	template <typename T> class queue
+	{
+		public:
+
+			queue() : head(new node()), tail(head.load()) { }
+
+			void push(const T &val)
+			{
+				node *n = new node(val);
+				enter();
+				for ( ;; )
+				{
+					node *t = tail;
+					node *next = t->next;
+					if ( next )
+					{
+						tail.compare_exchange_strong(t, next);
+						continue;
+					}
+					if ( t->next.compare_exchange_strong(next, n) )
+					{
+						tail.compare_exchange_strong(t, n);
+						break;
+					}
+				}
+				exit();
+			}
+
+			bool pop(T &val)
+			{
+				enter();
+				for ( ;; )
+				{
+					node *h = head;
+					node *next = h->next;
+					if ( !next )
+					{
+						exit();
+						return false;
+					}
+					node *t = tail;
+					if ( h == t )
+					{
+						tail.compare_exchange_strong(t, next);
+						continue;
+					}
+					val = next->val;
+					if ( head.compare_exchange_strong(h, next) )
+					{
+						retire(h);
+						exit();
+						return true;
+					}
+				}
+			}
+
+		private:
+
+			struct node
+			{
+				node() : val(), next(nullptr) { }
+				node(const T &v) : val(v), next(nullptr) { }
+				T val;
+				atomic<node *> next;
+			};
+
+			atomic<node *> head;
+			atomic<node *> tail;
+	};
+}
+
+/////////////////
+// Small nodes //
+/////////////////
+
+// The same node type allocated in the general heap and in a slab cache
+struct heap_node
+{
+	long key, val;
+	ptr<heap_node> next;
+};
+
+struct slab_node
+{
+	long key, val;
+	ptr<slab_node> next;
+};
+
+// A node that compact() may move
+struct tree_node
+{
+	long key;
+	ptr<tree_node> left, right;
+};
+
+// Nodes whose leaf, of another size class, is allocated by their constructor, which places it
+// near the node, or after construction
+struct leaf_node
+{
+	long vals[6];
+};
+
+struct nesting_node
+{
+	nesting_node() { leaf.alloc(); }
+	ptr<leaf_node> leaf;
+};
+
+struct late_node
+{
+	ptr<leaf_node> leaf;
+};
+
+namespace gcptr
+{
+	template <> struct slab_cached<slab_node> : std::true_type { };
+	template <> struct relocatable<tree_node> : std::true_type { };
+}
+
+////////////////
+// Benchmarks //
+////////////////
+
+// Each thread pushes and pops nops values
+template <typename Q> void bench_queue(const char *name)
+{
+	Q q;
+	atomic<long> sum(0);
+	run(name, [&](unsigned)
+	{
+		long s = 0;
+		int val;
+		for ( unsigned i = 0 ; i < nops ; i++ )
+		{
+			q.push(i);
+			if ( q.pop(val) )
+				s += val;
+		}
+		sum += s;
+	});
+}
+
+// Each thread does nops lookups or updates (1 in 8) on a shared key range
+template <typename M> void bench_map(const char *name)
+{
+	M m;
+	const unsigned nkeys = 4096;
+	for ( unsigned k = 0 ; k < nkeys ; k++ )
+		m.insert(k, k);
+	run(name, [&](unsigned id)
+	{
+		unsigned key = id, val;
+		for ( unsigned i = 0 ; i < nops ; i++ )
+		{
+			key = (key * 1103515245 + 12345) % nkeys;
+			if ( i % 8 == 0 )
+				m.insert(key, i);
+			else
+				m.find(key, val);
+		}
+	});
+}
+
+// Each thread allocates nops nodes, keeping the last ones accessible
+template <typename N> void bench_alloc(const char *name)
+{
+	run(name, [&](unsigned)
+	{
+		const unsigned nlive = 64;
+		ptr<N> live[nlive];
+		for ( unsigned i = 0 ; i < nops ; i++ )
+		{
+			live[i % nlive].alloc();
+			live[i % nlive]->key = i;
+		}
+	});
+}
+
+// Each thread walks a list of its own nops times with a local smart pointer, which is
+// linked as a root, or takes a slot of a root scope, at each step
+template <bool scoped> void bench_roots(const char *name)
+{
+	run(name, [&](unsigned)
+	{
+		const unsigned nnodes = 16;
+		ptr<heap_node> head;
+		for ( unsigned i = 0 ; i < nnodes ; i++ )
+		{
+			ptr<heap_node> n;
+			n.alloc();
+			n->key = i;
+			n->next = head;
+			head = n;
+		}
+		long sum = 0;
+		for ( unsigned i = 0 ; i < nops / nnodes ; i++ )
+		{
+			root_scope scope(scoped ? 4 : 0);
+			for ( ptr<heap_node> n = head ; n ; )
+			{
+				sum += n->key;
+				ptr<heap_node> next = n->next;
+				n = next;
+			}
+		}
+		if ( sum < 0 )
+			puts("");
+	});
+}
+
+// Each thread allocates nops nodes, replacing nodes of a ring of live ones, and the longest
+// allocation is reported: collections triggered by allocations stall them.
+void bench_latency(const char *name)
+{
+	atomic<long> worst(0);
+	run(name, [&](unsigned)
+	{
+		const unsigned nlive = 1 << 16;
+		vector<ptr<heap_node>> live(nlive);
+		long w = 0;
+		for ( unsigned i = 0 ; i < nops ; i++ )
+		{
+			auto start = chrono::high_resolution_clock::now();
+			live[i % nlive].alloc();
+			live[i % nlive]->next = live[(i + 1) % nlive];
+			long nsec = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - start).count();
+			if ( nsec > w )
+				w = nsec;
+		}
+		for ( long prev = worst ; w > prev && !worst.compare_exchange_weak(prev, w) ; )
+			;
+	});
+	printf("%-24s %8.1f us worst\n", "", worst / 1000.0);
+}
+
+long sum_tree(const tree_node *n)
+{
+	return n ? n->key + sum_tree(n->left ? &*n->left : nullptr) + sum_tree(n->right ? &*n->right : nullptr) : 0;
+}
+
+// A binary tree of nops nodes allocated in order, and linked in order or shuffled. A tree keeps
+// the recursive mark shallow where a list of this length would not.
+ptr<tree_node> build_tree(bool shuffle)
+{
+	vector<ptr<tree_node>> nodes(nops);
+	for ( unsigned i = 0 ; i < nops ; i++ )
+	{
+		nodes[i].alloc();
+		nodes[i]->key = i;
+	}
+	for ( unsigned i = nops - 1 ; shuffle && i > 0 ; i-- )
+		swap(nodes[i], nodes[rand() % (i + 1)]);
+	for ( unsigned i = 0 ; 2 * i + 1 < nops ; i++ )
+	{
+		nodes[i]->left = nodes[2 * i + 1];
+		if ( 2 * i + 2 < nops )
+			nodes[i]->right = nodes[2 * i + 2];
+	}
+	return nodes[0];
+}
+
+// A shuffled tree is traversed before and after compact() moves the nodes into trace order,
+// with or without a reserved range.
+void bench_compact(const char *name, bool reserve)
+{
+	in_child([&]
+	{
+		if ( reserve )
+			heap_reserve(size_t(1) << 32);
+		ptr<tree_node> root = build_tree(true);
+
+		auto traverse = [&]
+		{
+			auto start = chrono::high_resolution_clock::now();
+			long sum = 0;
+			for ( int pass = 0 ; pass < 10 ; pass++ )
+				sum += sum_tree(&*root);
+			if ( sum < 0 )
+				puts("");
+			return chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count() / 10.0;
+		};
+		double before = traverse();
+		compact();
+		double after = traverse();
+		printf("%-24s %8.1f ms %8.1f ms after, %.1fx\n", name, before / 1000.0, after / 1000.0, before / after);
+	});
+}
+
+// Nodes replace those of a ring of live ones, while unrelated leaves churn in a second ring,
+// with a reserved range, and the share of leaves in the 4 KB page of their node is reported.
+template <typename N> void bench_locality(const char *name)
+{
+	in_child([&]
+	{
+		heap_reserve(size_t(1) << 32);
+		const unsigned nlive = 1 << 14;
+		vector<ptr<N>> live(nlive);
+		vector<ptr<leaf_node>> others(nlive);
+		for ( unsigned i = 0 ; i < nops ; i++ )
+		{
+			others[rand() % nlive].alloc();
+			ptr<N> &n = live[rand() % nlive];
+			n.alloc();
+			if ( !n->leaf )
+				n->leaf.alloc();
+		}
+		unsigned near = 0, count = 0;
+		for ( auto &n : live )
+			if ( n )
+			{
+				count++;
+				near += uintptr_t(&*n) >> 12 == uintptr_t(&*n->leaf) >> 12;
+			}
+		printf("%-24s %7.1f %% of leaves in the page of their node\n", name, 100.0 * near / count);
+	});
+}
+
+// A static object whose destructor collects, as destructors of static containers may do
+struct exit_collector
+{
+	~exit_collector() { collect(); }
+};
+
+// A child process exits with a tree held by a leaked root, and the time from its call to
+// exit() to its end is reported. Without fast exit, the static object collects the tree.
+void bench_exit(const char *name, bool fast)
+{
+	int fds[2];
+	if ( pipe(fds) )
+		return;
+	fflush(stdout);
+	pid_t pid = fork();
+	if ( !pid )
+	{
+		static exit_collector ec;				// Destroyed after the fast exit
+		fast_exit(fast);
+		new ptr<tree_node>(build_tree(false));
+		if ( write(fds[1], "x", 1) != 1 )
+			_exit(1);
+		exit(0);
+	}
+	char c;
+	bool ok = read(fds[0], &c, 1) == 1;
+	auto start = chrono::high_resolution_clock::now();
+	waitpid(pid, nullptr, 0);
+	long usec = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+	close(fds[0]);
+	close(fds[1]);
+	if ( ok )
+		printf("%-24s %8.2f ms\n", name, usec / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	if ( argc > 1 && atoi(argv[1]) > 0 )
+		nthr = atoi(argv[1]);
+	if ( argc > 2 && atoi(argv[2]) > 0 )
+		nops = atoi(argv[2]);
+	bool regions = argc > 3 && !strcmp(argv[3], "regions") && heap_regions();
+	printf("%u threads, %u operations per thread%s\n", nthr, nops, regions ? ", mark-region heap" : "");
+
+	bench_compact("compact traversal", false);
+	bench_compact("reserved compact trav.", true);
+	bench_locality<nesting_node>("nested leaves");
+	bench_locality<late_node>("leaves after construction");
+	bench_exit("exit", false);
+	bench_exit("fast exit", true);
+
+	bench_queue<concurrent_queue<int>>("gcptr queue");
+	bench_queue<mutex_queue<int>>("mutex queue");
+	bench_queue<ebr::queue<int>>("epoch-based queue");
+	bench_map<concurrent_map<unsigned, unsigned>>("gcptr map");
+	bench_map<mutex_map<unsigned, unsigned>>("mutex map");
+	bench_alloc<heap_node>("general heap nodes");
+	bench_alloc<slab_node>("slab-cached nodes");
+	bench_roots<false>("local roots");
+	bench_roots<true>("scoped local roots");
+	bench_latency("allocation latency");
+	collect_realtime(true);
+	bench_latency("real-time latency");
+	collect_realtime(false);
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef GCCORO_H
+#define GCCORO_H
+
+// C++20 coroutines with frames on the garbage-collected heap.
+// Smart pointers held across suspension points live in the coroutine frame. With the
+// promise types below, the frame is a garbage-collected block and those smart pointers are
+// its members instead of roots, so cycles through suspended coroutines are collected, and
+// a suspended coroutine that nobody can resume any more is destroyed by the collector.
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include "gcptr.h"
+
+namespace gcptr
+{
+	// Smart pointer to a coroutine frame allocated by gc_promise. Keep one wherever a
+	// coroutine handle is kept for resuming the coroutine later: frames not referenced by
+	// any smart pointer are garbage.
+	class coro_ptr : public basic_ptr
+	{
+		public:
+
+			coro_ptr() = default;
+			explicit coro_ptr(std::coroutine_handle<> h) { if ( h ) frame_attach(h.address()); }
+
+			std::coroutine_handle<> handle() const { return std::coroutine_handle<>::from_address(pval); }
+			explicit operator bool() const { return pval != nullptr; }
+			bool done() const { return handle().done(); }
+			void resume() const { handle().resume(); }
+
+			// Frame management, used by gc_promise
+			static void *alloc(std::size_t size) { return frame_alloc(size, destroy); }
+			static void free(void *fr) { frame_free(fr); }
+			static void enter(void *fr) { frame_enter(fr); }
+			static void leave(void *fr) { frame_leave(fr); }
+
+		private:
+
+			static void destroy(void *fr) { std::coroutine_handle<>::from_address(fr).destroy(); }
+	};
+
+	// Awaiter wrapper that leaves the frame when the coroutine suspends and enters it again
+	// when it resumes, so that smart pointers created in the frame are recognized as members.
+	template <typename A> struct frame_awaiter
+	{
+		A awaiter;
+		void *frame;
+
+		bool await_ready() noexcept(noexcept(awaiter.await_ready())) { return awaiter.await_ready(); }
+
+		template <typename P>
+		auto await_suspend(std::coroutine_handle<P> h) noexcept(noexcept(awaiter.await_suspend(h)))
+		{
+			coro_ptr::leave(frame);
+			if constexpr ( std::is_same<decltype(awaiter.await_suspend(h)), bool>::value )
+			{
+				if ( awaiter.await_suspend(h) )
+					return true;
+				coro_ptr::enter(frame);
+				return false;
+			}
+			else
+				return awaiter.await_suspend(h);
+		}
+
+		decltype(auto) await_resume() noexcept(noexcept(awaiter.await_resume()))
+		{
+			coro_ptr::enter(frame);
+			return awaiter.await_resume();
+		}
+	};
+
+	// Base class of promise types whose frames are allocated on the garbage-collected heap.
+	// co_await expressions are wrapped by await_transform(); initial_suspend() and
+	// final_suspend() of derived promise types must wrap their awaiters with suspend().
+	template <typename Promise> struct gc_promise
+	{
+		static void *operator new(std::size_t size) { return coro_ptr::alloc(size); }
+		static void operator delete(void *fr) { coro_ptr::free(fr); }
+
+		template <typename A> frame_awaiter<A> suspend(A &&a) noexcept
+		{
+			return frame_awaiter<A>{ std::forward<A>(a), frame() };
+		}
+
+		template <typename A> auto await_transform(A &&a)
+		{
+			if constexpr ( requires { std::forward<A>(a).operator co_await(); } )
+				return suspend(std::forward<A>(a).operator co_await());
+			else
+				return suspend(std::forward<A>(a));
+		}
+
+		void *frame() noexcept
+		{
+			return std::coroutine_handle<Promise>::from_promise(static_cast<Promise &>(*this)).address();
+		}
+	};
+
+	// Coroutine on the garbage-collected heap, started and resumed explicitly.
+	// It may be dropped while suspended, the collector destroys it.
+	class coroutine
+	{
+		public:
+
+			struct promise_type : gc_promise<promise_type>
+			{
+				coroutine get_return_object()
+				{
+					return coroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+				}
+				frame_awaiter<std::suspend_always> initial_suspend() noexcept { return suspend(std::suspend_always()); }
+				frame_awaiter<std::suspend_always> final_suspend() noexcept { return suspend(std::suspend_always()); }
+				void return_void() { }
+				void unhandled_exception() { exception = std::current_exception(); }
+
+				std::exception_ptr exception;
+			};
+
+			coroutine() = default;
+
+			// Run until the next suspension. Returns false if the coroutine has finished.
+			// Exceptions escaping from the coroutine body are rethrown here.
+			bool resume()
+			{
+				if ( !frame || frame.done() )
+					return false;
+				frame.resume();
+				auto h = std::coroutine_handle<promise_type>::from_address(frame.handle().address());
+				if ( h.promise().exception )
+					std::rethrow_exception(std::exchange(h.promise().exception, nullptr));
+				return !h.done();
+			}
+
+			bool done() const { return !frame || frame.done(); }
+
+			// The frame, for resuming from elsewhere.
+			const coro_ptr &handle() const { return frame; }
+
+		private:
+
+			explicit coroutine(std::coroutine_handle<> h) : frame(h) { }
+
+			coro_ptr frame;
+	};
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef GCMAP_H
+#define GCMAP_H
+
+#include <functional>
+#include <vector>
+#include "gcptr.h"
+
+namespace gcptr
+{
+	// Lock-free concurrent hash map with a fixed number of buckets.
+	// Each bucket is an atomic smart pointer to an immutable chain of garbage-collected nodes.
+	// Readers walk a chain without synchronization; writers build a new chain sharing the
+	// unchanged tail of the old one and publish it with compare_exchange. Replaced nodes are
+	// reclaimed by the collector once no reader refers to them.
+	template <typename K, typename V, typename Hash = std::hash<K>> class concurrent_map
+	{
+		public:
+
+			// The number of buckets is rounded up to a power of two.
+			explicit concurrent_map(unsigned nbuckets = 1024) : mask(1)
+			{
+				while ( mask < nbuckets )
+					mask <<= 1;
+				buckets.alloc_array(mask--);
+			}
+
+			concurrent_map(const concurrent_map &) = delete;
+			concurrent_map &operator =(const concurrent_map &) = delete;
+
+			// Copy the value associated to key to val. Returns false if key is not present.
+			bool find(const K &key, V &val) const
+			{
+				for ( ptr<node> n = bucket(key).load() ; n ; n = n->next )
+					if ( n->key == key )
+					{
+						val = n->val;
+						return true;
+					}
+				return false;
+			}
+
+			// Associate val to key. Returns true if key was not present.
+			bool insert(const K &key, const V &val)
+			{
+				atomic_ptr<node> &b = bucket(key);
+				ptr<node> head = b.load();
+				for ( ;; )
+				{
+					bool found;
+					ptr<node> n;
+					n.alloc(key, val, remove(head, key, found));
+					if ( b.compare_exchange(head, n) )
+						return !found;
+				}
+			}
+
+			// Remove key. Returns true if it was present.
+			bool erase(const K &key)
+			{
+				atomic_ptr<node> &b = bucket(key);
+				ptr<node> head = b.load();
+				for ( ;; )
+				{
+					bool found;
+					ptr<node> rest = remove(head, key, found);
+					if ( !found )
+						return false;
+					if ( b.compare_exchange(head, rest) )
+						return true;
+				}
+			}
+
+		private:
+
+			struct node
+			{
+				node(const K &k, const V &v, const ptr<node> &n) : key(k), val(v), next(n) { }
+
+				const K key;
+				const V val;
+				ptr<node> next;
+			};
+
+			atomic_ptr<node> &bucket(const K &key) const { return buckets[Hash()(key) & mask]; }
+
+			// Return a chain equal to head without the node holding key. The nodes before it
+			// are copied, the nodes after it are shared. Nodes in the chain are kept alive by
+			// head, so they can be remembered by real pointers.
+			static ptr<node> remove(const ptr<node> &head, const K &key, bool &found)
+			{
+				std::vector<node *> prefix;
+				node *n = head;
+				for ( ; n && !(n->key == key) ; n = n->next )
+					prefix.push_back(n);
+				if ( !(found = n != nullptr) )
+					return head;
+
+				ptr<node> rest = n->next;
+				while ( !prefix.empty() )
+				{
+					ptr<node> copy;
+					copy.alloc(prefix.back()->key, prefix.back()->val, rest);
+					rest = copy;
+					prefix.pop_back();
+				}
+				return rest;
+			}
+
+			ptr<atomic_ptr<node>> buckets;
+			unsigned mask;
+	};
+}
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef GCPERSIST_H
+#define GCPERSIST_H
+
+#include <functional>
+#include "gcptr.h"
+
+namespace gcptr
+{
+	// Persistent (immutable) collections with structural sharing.
+	// Updates return a new version in O(log n) that shares all unchanged nodes with the old
+	// one; versions nobody refers to any more are reclaimed by the collector. Copying a
+	// version is O(1). A version never changes, so any number of threads may read it without
+	// synchronization; to publish versions between threads, keep them in garbage-collected
+	// objects and hand these over through an atomic_ptr.
+
+	// Hash array mapped trie. Nodes have up to 32 entries selected by 5 bits of the hash,
+	// present entries are flagged in a bitmap. Keys whose hashes are equal end up in
+	// collision nodes, searched linearly.
+	template <typename K, typename V, typename Hash = std::hash<K>> class persistent_map
+	{
+		public:
+
+			persistent_map() : count(0) { }
+
+			// Number of keys.
+			unsigned size() const { return count; }
+
+			// Copy the value associated to key to val. Returns false if key is not present.
+			bool find(const K &key, V &val) const
+			{
+				size_t hash = Hash()(key);
+				const node *n = root;
+				for ( unsigned shift = 0 ; n ; shift += bits )
+				{
+					if ( shift >= hash_bits )		// Collision node
+					{
+						for ( unsigned i = 0 ; i < n->count ; i++ )
+							if ( n->entries[i].leaf->key == key )
+							{
+								val = n->entries[i].leaf->val;
+								return true;
+							}
+						return false;
+					}
+					unsigned bit = 1u << ((hash >> shift) & mask);
+					if ( !(n->bitmap & bit) )
+						return false;
+					const entry &e = n->entries[index(n->bitmap, bit)];
+					if ( e.leaf )
+					{
+						if ( !(e.leaf->key == key) )
+							return false;
+						val = e.leaf->val;
+						return true;
+					}
+					n = e.sub;
+				}
+				return false;
+			}
+
+			// Version with val associated to key.
+			persistent_map set(const K &key, const V &val) const
+			{
+				ptr<item> it;
+				it.alloc(Hash()(key), key, val);
+				bool added = false;
+				persistent_map m;
+				m.root = insert(root, it, 0, added);
+				m.count = count + added;
+				return m;
+			}
+
+			// Version without key.
+			persistent_map erase(const K &key) const
+			{
+				bool removed = false;
+				persistent_map m;
+				m.root = remove(root, Hash()(key), key, 0, removed);
+				m.count = count - removed;
+				return m;
+			}
+
+		private:
+
+			constexpr static unsigned bits = 5;
+			constexpr static unsigned mask = (1u << bits) - 1;
+			constexpr static unsigned hash_bits = 8 * sizeof(size_t);
+
+			struct item
+			{
+				item(size_t h, const K &k, const V &v) : hash(h), key(k), val(v) { }
+
+				const size_t hash;
+				const K key;
+				const V val;
+			};
+
+			struct node;
+
+			// Either a subnode or a leaf holding a key and its value
+			struct entry
+			{
+				ptr<node> sub;
+				ptr<item> leaf;
+			};
+
+			struct node
+			{
+				node(unsigned bm, unsigned n) : bitmap(bm), count(n) { entries.alloc_array(n); }
+
+				unsigned bitmap;
+				unsigned count;
+				ptr<entry> entries;
+			};
+
+			// Position of an entry in a node
+			static unsigned index(unsigned bitmap, unsigned bit) { return __builtin_popcount(bitmap & (bit - 1)); }
+
+			// Copy the entries of n to a new node, leaving a hole at position 'at' if the new
+			// node is bigger or skipping that position if it is smaller.
+			static ptr<node> copy(const node &n, unsigned bitmap, unsigned count, unsigned at)
+			{
+				ptr<node> r;
+				r.alloc(bitmap, count);
+				for ( unsigned i = 0, j = 0 ; i < n.count ; i++, j++ )
+				{
+					if ( i == at && count < n.count )
+						i++;
+					if ( j == at && count > n.count )
+						j++;
+					if ( i == n.count )
+						break;
+					r->entries[j].sub = n.entries[i].sub;
+					r->entries[j].leaf = n.entries[i].leaf;
+				}
+				return r;
+			}
+
+			// Insert a leaf in the subtrie at n, null if empty.
+			static ptr<node> insert(const ptr<node> &n, const ptr<item> &it, unsigned shift, bool &added)
+			{
+				if ( shift >= hash_bits )			// Collision node
+				{
+					unsigned i = 0, count = n ? n->count : 0;
+					while ( i < count && !(n->entries[i].leaf->key == it->key) )
+						i++;
+					added = i == count;
+					ptr<node> r;
+					if ( n )
+						r = copy(*n, 0, count + added, count);
+					else
+						r.alloc(0u, 1u);
+					r->entries[i].leaf = it;
+					return r;
+				}
+
+				unsigned bit = 1u << ((it->hash >> shift) & mask);
+				if ( !n )
+				{
+					ptr<node> r;
+					r.alloc(bit, 1u);
+					r->entries[0].leaf = it;
+					added = true;
+					return r;
+				}
+
+				unsigned i = index(n->bitmap, bit);
+				if ( !(n->bitmap & bit) )			// New entry
+				{
+					ptr<node> r = copy(*n, n->bitmap | bit, n->count + 1, i);
+					r->entries[i].leaf = it;
+					added = true;
+					return r;
+				}
+
+				const entry &e = n->entries[i];
+				ptr<node> r = copy(*n, n->bitmap, n->count, n->count);
+				if ( e.sub )						// Insert in subtrie
+					r->entries[i].sub = insert(e.sub, it, shift + bits, added);
+				else if ( e.leaf->key == it->key )	// Replace leaf
+					r->entries[i].leaf = it;
+				else								// Push both leaves down
+				{
+					bool dummy;
+					r->entries[i].sub = insert(insert(ptr<node>(), e.leaf, shift + bits, dummy),
+						it, shift + bits, added);
+					r->entries[i].leaf = ptr<item>();
+				}
+				return r;
+			}
+
+			// Remove a key from the subtrie at n. Returns null if the subtrie becomes empty.
+			static ptr<node> remove(const ptr<node> &n, size_t hash, const K &key, unsigned shift, bool &removed)
+			{
+				if ( !n )
+					return n;
+
+				if ( shift >= hash_bits )			// Collision node
+				{
+					unsigned i = 0;
+					while ( i < n->count && !(n->entries[i].leaf->key == key) )
+						i++;
+					if ( i == n->count )
+						return n;
+					removed = true;
+					return n->count == 1 ? ptr<node>() : copy(*n, 0, n->count - 1, i);
+				}
+
+				unsigned bit = 1u << ((hash >> shift) & mask);
+				if ( !(n->bitmap & bit) )
+					return n;
+
+				unsigned i = index(n->bitmap, bit);
+				const entry &e = n->entries[i];
+				ptr<node> sub;
+				if ( e.leaf )
+				{
+					if ( !(e.leaf->key == key) )
+						return n;
+					removed = true;
+				}
+				else
+				{
+					sub = remove(e.sub, hash, key, shift + bits, removed);
+					if ( !removed )
+						return n;
+				}
+
+				if ( !sub )							// Drop the entry
+					return n->count == 1 ? ptr<node>() : copy(*n, n->bitmap & ~bit, n->count - 1, i);
+
+				ptr<node> r = copy(*n, n->bitmap, n->count, n->count);
+				if ( sub->count == 1 && sub->entries[0].leaf )	// Pull up a single leaf
+					r->entries[i].leaf = sub->entries[0].leaf;
+				r->entries[i].sub = r->entries[i].leaf ? ptr<node>() : sub;
+				return r;
+			}
+
+			ptr<node> root;
+			unsigned count;
+	};
+
+	// Persistent vector: a trie of 32-way nodes indexed by 5-bit slices of the index, with
+	// the elements in the leaves. Elements must be default constructible and assignable.
+	template <typename T> class persistent_vector
+	{
+		public:
+
+			persistent_vector() : count(0), shift(0) { }
+
+			// Number of elements.
+			unsigned size() const { return count; }
+
+			// Element access, not bounds-checked.
+			const T &operator [](unsigned i) const
+			{
+				const node *n = root;
+				for ( unsigned s = shift ; s ; s -= bits )
+					n = n->children[(i >> s) & mask];
+				return n->values[i & mask];
+			}
+
+			// Version with element i replaced by val.
+			persistent_vector set(unsigned i, const T &val) const
+			{
+				if ( i >= count )
+					throw ptr_exception("persistent_vector index out of range");
+				persistent_vector v(*this);
+				v.root = set(root, shift, i, val);
+				return v;
+			}
+
+			// Version with val appended.
+			persistent_vector push_back(const T &val) const
+			{
+				persistent_vector v(*this);
+				if ( !root )
+					v.root = path(0, val);
+				else if ( count == (1u << (shift + bits)) )	// Full, grow a level
+				{
+					v.root.alloc(2u, false);
+					v.root->children[0] = root;
+					v.root->children[1] = path(shift, val);
+					v.shift += bits;
+				}
+				else
+					v.root = push(root, shift, count, val);
+				v.count++;
+				return v;
+			}
+
+		private:
+
+			constexpr static unsigned bits = 5;
+			constexpr static unsigned mask = (1u << bits) - 1;
+
+			// Inner nodes have children, leaves have values
+			struct node
+			{
+				node(unsigned n, bool leaf) : count(n)
+				{
+					if ( leaf )
+						values.alloc_array(n);
+					else
+						children.alloc_array(n);
+				}
+
+				unsigned count;
+				ptr<ptr<node>> children;
+				ptr<T> values;
+			};
+
+			// Copy a node, with size n
+			static ptr<node> copy(const node &src, unsigned n)
+			{
+				ptr<node> r;
+				r.alloc(n, !src.children);
+				for ( unsigned i = 0 ; i < src.count && i < n ; i++ )
+					if ( src.children )
+						r->children[i] = src.children[i];
+					else
+						r->values[i] = src.values[i];
+				return r;
+			}
+
+			// New path of nodes down to a leaf holding val
+			static ptr<node> path(unsigned s, const T &val)
+			{
+				ptr<node> r;
+				r.alloc(1u, s == 0);
+				if ( s )
+					r->children[0] = path(s - bits, val);
+				else
+					r->values[0] = val;
+				return r;
+			}
+
+			// Append val at position i of the subtrie at n
+			static ptr<node> push(const ptr<node> &n, unsigned s, unsigned i, const T &val)
+			{
+				unsigned j = (i >> s) & mask;
+				ptr<node> r = copy(*n, j < n->count ? n->count : j + 1);
+				if ( !s )
+					r->values[j] = val;
+				else if ( j < n->count )
+					r->children[j] = push(n->children[j], s - bits, i, val);
+				else
+					r->children[j] = path(s - bits, val);
+				return r;
+			}
+
+			// Replace position i of the subtrie at n by val
+			static ptr<node> set(const ptr<node> &n, unsigned s, unsigned i, const T &val)
+			{
+				unsigned j = (i >> s) & mask;
+				ptr<node> r = copy(*n, n->count);
+				if ( s )
+					r->children[j] = set(n->children[j], s - bits, i, val);
+				else
+					r->values[j] = val;
+				return r;
+			}
+
+			ptr<node> root;
+			unsigned count;
+			unsigned shift;
+	};
+}
+
+#endif
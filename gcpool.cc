@@ -0,0 +1,172 @@
+#include "gcpool.h"
+#include <chrono>
+
+using namespace std;
+
+// Platform definitions (for GCC 4.6)
+#define TLS			__thread				// Should be 'thread_local' for C++11.
+
+namespace
+{
+	// Pool and deque of the current worker thread
+	TLS gcptr::task_pool *current_pool;
+	TLS unsigned current_index;
+}
+
+namespace gcptr
+{
+	/////////////////////
+	// Class task_pool //
+	/////////////////////
+
+	task_pool::task_pool(unsigned nthreads) : workers(nthreads ? nthreads : 1), next(0), queued(0),
+		outstanding(0), running(workers.size()), parked(0), collections(0), stopping(false)
+	{
+		for ( unsigned i = 0 ; i < workers.size() ; i++ )
+			threads.push_back(thread(&task_pool::run, this, i));
+	}
+
+	task_pool::~task_pool()
+	{
+		wait();
+		m.lock();
+		stopping = true;
+		m.unlock();
+		work_cv.notify_all();
+		for ( auto &t : threads )
+			t.join();
+	}
+
+	void task_pool::submit(function<void()> task)
+	{
+		unsigned i = current_pool == this ? current_index : next++ % workers.size();
+		outstanding++;
+		workers[i].m.lock();
+		workers[i].tasks.push_back(move(task));
+		workers[i].m.unlock();
+		queued++;
+
+		lock_guard<mutex> lg(m);				// Don't notify between check and wait
+		work_cv.notify_one();
+	}
+
+	void task_pool::wait()
+	{
+		unique_lock<mutex> lk(m);
+		while ( outstanding )
+			done_cv.wait(lk);
+	}
+
+	// Worker thread
+	void task_pool::run(unsigned index)
+	{
+		current_pool = this;
+		current_index = index;
+		defer_collections(true);
+
+		function<void()> task;
+		for ( ;; )
+		{
+			if ( collection_pending() )			// Task boundary
+			{
+				unique_lock<mutex> lk(m);
+				safepoint(lk, true);
+				lk.unlock();
+				while ( collect_sweep(64 * 1024) )	// Together with the other workers
+					;
+			}
+
+			if ( pop(index, task) || steal(index, task) )
+			{
+				try
+				{
+					task();
+				}
+				catch (...)
+				{
+					// Ignore exceptions
+				}
+				task = nullptr;
+				if ( !--outstanding )
+				{
+					lock_guard<mutex> lg(m);
+					done_cv.notify_all();
+				}
+				continue;
+			}
+
+			// Idle: sweep, then sleep until there is work, a collection to join or the pool stops
+			while ( !queued && collect_sweep(64 * 1024) )
+				;
+			unique_lock<mutex> lk(m);
+			while ( !queued && !stopping && !collection_pending() )
+				work_cv.wait(lk);
+			if ( stopping && !queued )
+			{
+				running--;
+				safepoint(lk, false);			// Complete a rendezvous waiting for this worker
+				return;
+			}
+		}
+	}
+
+	// Arrive at the safepoint and wait until the pending collection is done, or just check
+	// whether the workers already there are all the running ones. The last worker to arrive
+	// runs the collection. Called with m locked.
+	void task_pool::safepoint(unique_lock<mutex> &lk, bool arrive)
+	{
+		if ( !collection_pending() )
+			return;
+
+		unsigned gen = collections;
+		if ( arrive )
+			parked++;
+		if ( parked && parked == running )
+		{
+			lk.unlock();						// Destructors may submit tasks
+			collect();
+			lk.lock();
+			parked = 0;
+			collections++;
+			gc_cv.notify_all();
+			return;
+		}
+
+		if ( !arrive )
+			return;
+
+		// Wait, unless a thread outside the pool collects in the meantime
+		work_cv.notify_all();					// Idle workers join the rendezvous
+		while ( collections == gen && collection_pending() )
+			gc_cv.wait_for(lk, chrono::milliseconds(1));
+		if ( collections == gen )
+			parked--;
+	}
+
+	bool task_pool::pop(unsigned index, function<void()> &task)
+	{
+		lock_guard<mutex> lg(workers[index].m);
+		if ( workers[index].tasks.empty() )
+			return false;
+		task = move(workers[index].tasks.back());
+		workers[index].tasks.pop_back();
+		queued--;
+		return true;
+	}
+
+	bool task_pool::steal(unsigned index, function<void()> &task)
+	{
+		for ( unsigned i = 1 ; i < workers.size() ; i++ )
+		{
+			worker &w = workers[(index + i) % workers.size()];
+			lock_guard<mutex> lg(w.m);
+			if ( w.tasks.empty() )
+				continue;
+			task = move(w.tasks.front());
+			w.tasks.pop_front();
+			queued--;
+			return true;
+		}
+		return false;
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef GCPOOL_H
+#define GCPOOL_H
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "gcptr.h"
+
+namespace gcptr
+{
+	// Work-stealing thread pool whose task boundaries are garbage collection safepoints.
+	// Workers defer the collections triggered by their allocations, so they are never stalled
+	// by a collection in the middle of a task. When a collection is pending, each worker
+	// stops at its next task boundary and idle workers join right away; the last one to
+	// arrive collects and releases the others. Tasks must not block waiting for other tasks
+	// of the same pool, since that would keep their worker away from the safepoint.
+	// The one exception is memory: if allocations reach twice the collection threshold before
+	// all workers have arrived, e.g. during a long task, the worker allocating then collects
+	// in the middle of its task (see defer_collections()).
+	// Marking is done by the collecting worker alone. The other workers help with sweeping:
+	// in the lazy and background sweep modes, all the workers released from the safepoint
+	// sweep the garbage found in parallel before they resume, and idle workers sweep
+	// pending garbage before they sleep.
+	class task_pool
+	{
+		public:
+
+			explicit task_pool(unsigned nthreads = std::thread::hardware_concurrency());
+			~task_pool();
+
+			task_pool(const task_pool &) = delete;
+			task_pool &operator =(const task_pool &) = delete;
+
+			// Queue a task. Tasks submitted by a worker go to its own deque, others are
+			// distributed round-robin. Exceptions thrown by tasks are ignored.
+			void submit(std::function<void()> task);
+
+			// Wait until all submitted tasks have finished. Not to be called from a task.
+			void wait();
+
+		private:
+
+			// Worker deque: the owner pops at the back, thieves steal at the front.
+			struct worker
+			{
+				std::mutex m;
+				std::deque<std::function<void()>> tasks;
+			};
+
+			void run(unsigned index);
+			bool pop(unsigned index, std::function<void()> &task);
+			bool steal(unsigned index, std::function<void()> &task);
+			void safepoint(std::unique_lock<std::mutex> &lk, bool arrive);
+
+			std::vector<worker> workers;
+			std::vector<std::thread> threads;
+			std::atomic<unsigned> next;			// Round-robin for external submissions
+			std::atomic<unsigned> queued;		// Tasks in the deques
+			std::atomic<unsigned> outstanding;	// Tasks submitted and not finished
+
+			std::mutex m;						// Serializes the members below
+			std::condition_variable work_cv;	// Work available, stopping or collection pending
+			std::condition_variable gc_cv;		// Collection finished
+			std::condition_variable done_cv;	// All tasks finished
+			unsigned running;					// Workers not stopped
+			unsigned parked;					// Workers waiting at the safepoint
+			unsigned collections;				// Collections run at the safepoint
+			bool stopping;
+	};
+}
+
+#endif
@@ -1,11 +1,23 @@
 #include "gcptr.h"
 
 #include <mutex>
+#include <atomic>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <cstring>
 #include <algorithm>
+#include <new>
+#include <sys/mman.h>
+#include <thread>
+#include <condition_variable>
+#include <pthread.h>
 
 using namespace std;
 
-#define GC_DEBUG	true
+#ifndef GC_DEBUG
+	#define GC_DEBUG	true
+#endif
 
 // Debugger	
 #if GC_DEBUG
@@ -27,32 +39,92 @@ using namespace std;
 
 namespace
 {
+	// Recursive mutex over a plain one. recursive_mutex records its owner by kernel thread id,
+	// which changes in a forked child, so that the child can't unlock what the forking thread
+	// locked; this one records the owner by thread::id, which fork keeps.
+	struct recursive_lock
+	{
+		mutex m;
+		atomic<thread::id> owner;
+		unsigned depth = 0;				// Changed by the owner only
+
+		void lock()
+		{
+			if ( owner.load(memory_order_relaxed) != this_thread::get_id() )
+			{
+				m.lock();
+				owner.store(this_thread::get_id(), memory_order_relaxed);
+			}
+			depth++;
+		}
+
+		bool try_lock()
+		{
+			if ( owner.load(memory_order_relaxed) != this_thread::get_id() )
+			{
+				if ( !m.try_lock() )
+					return false;
+				owner.store(this_thread::get_id(), memory_order_relaxed);
+			}
+			depth++;
+			return true;
+		}
+
+		void unlock()
+		{
+			if ( --depth )
+				return;
+			owner.store(thread::id(), memory_order_relaxed);
+			m.unlock();
+		}
+	};
+
 	// Garbage collection globals
 	unsigned threshold = 100 * 1024;		// Allocated memory threshold.
 	unsigned allocated;						// Memory allocated since last collection.
-	recursive_mutex gc_m;					// Serialize GC
+	atomic<bool> pending;					// Allocated memory has reached the threshold.
+	atomic<bool> overdue;					// Allocated memory has reached twice the threshold.
+	TLS bool deferred;						// Don't collect on allocation in this thread.
+	recursive_lock gc_m;					// Serialize GC
+	atomic<bool> realtime;					// Collections run on the collector thread.
+	recursive_lock cycle_m;					// Serialize real-time collections and compaction.
+	atomic<bool> exiting;					// Fast exit in progress, collections are off.
 }
 
 namespace gcptr
 {
+	/////////////////////////
+	// Thread-private heap //
+	/////////////////////////
+
+	struct local_heap
+	{
+		mutex m;					// Serialize the blocks set
+		set<mblock *> blocks;		// Active private blocks, ordered by address
+		unsigned allocated;			// Memory allocated since last private collection
+
+		local_heap() : allocated(0) { }
+	};
+
 	/////////////////////////
 	// Memory block header //
 	/////////////////////////
 
 	struct mblock
 	{
-		destructor destroy;			// Object array destructor
+		const objtype *type;		// Object type
 		basic_ptr *members;			// Member smart pointers
 		mblock *next;				// Next in list 
+		local_heap *owner;			// Heap of a thread-private block, null if shared
 		unsigned nelems;			// Number of elements in object array
 		unsigned objsize;			// Size of object area
 		bool active;				// Block is candidate for GC
 		bool marked;				// Block is accessible
 
-		mblock(unsigned nels, unsigned size, destructor destr) : destroy(destr), members(nullptr),
-			nelems(nels), objsize(size), active(false), marked(false) { }
+		mblock(unsigned nels, unsigned size, const objtype &t) : type(&t), members(nullptr),
+			owner(nullptr), nelems(nels), objsize(size), active(false), marked(false) { }
 
-		~mblock() { if ( destroy ) destroy(obj(), nelems); }
+		~mblock() { if ( type->destroy ) type->destroy(obj(), nelems); }
 
 		// Define the size of this structure so that the object area is maximally aligned.
 		constexpr static unsigned size() { return sizeof(aligned_storage<sizeof(mblock)>::type); }
@@ -63,122 +135,2206 @@ namespace gcptr
 		// Is an address contained in the object area?
 		bool contains(const void *addr) { return addr >= obj() && addr < obj() + objsize; }
 	};	
+
+	////////////////
+	// Slab cache //
+	////////////////
+
+	// Slots of a slab-cached type, each one holding a block with a single object. Slabs are
+	// taken from the general heap and never given back.
+	struct slab_cache
+	{
+		mutex m;					// Serialize the cache
+		unsigned objsize;			// Size of the object area of a slot
+		size_t slot;				// Size of a slot
+		void *free;					// Free slots, linked through their first word
+		char *top;					// Never allocated slots of the last slab
+		char *end;
+
+		slab_cache(unsigned size) : objsize(size), slot((mblock::size() + size + 15) / 16 * 16),
+			free(nullptr), top(nullptr), end(nullptr) { }
+	};
+
+	//////////////////
+	// Recycle pool //
+	//////////////////
+
+	// Blocks of a recycled type whose object was reset, to be reused by alloc().
+	TLS bool clearing;					// The visitor clears traced pointers, see put()
+
+	struct recycle_pool
+	{
+		constexpr static unsigned max_objects = 1024;
+
+		mutex m;					// Serialize the pool
+		mblock *blocks;				// Pooled blocks, linked through next
+		unsigned count;				// Pooled blocks, and blocks being reset
+
+		recycle_pool() : blocks(nullptr), count(0) { }
+
+		// Reset the object of a swept block and keep the block. Its member and traced smart
+		// pointers and compressed references are cleared first, so that it keeps no garbage
+		// alive. Returns false if the pool is full or the resetter threw.
+		bool put(mblock *mb)
+		{
+			{
+				lock_guard<mutex> lg(m);
+				if ( count == max_objects )
+					return false;
+				count++;
+			}
+			for ( basic_ptr *p = mb->members ; p ; p = p->next )
+			{
+				p->mem = nullptr;
+				p->pval = nullptr;
+			}
+			if ( mb->type->trace )
+			{
+				clearing = true;
+				visitor v;
+				mb->type->trace(mb->obj(), mb->nelems, v);
+				clearing = false;
+			}
+			bool reset = true;
+			try
+			{
+				mb->type->reset(mb->obj());
+			}
+			catch (...)
+			{
+				reset = false;
+			}
+			lock_guard<mutex> lg(m);
+			if ( !reset )
+			{
+				count--;
+				return false;
+			}
+			mb->active = false;
+			mb->owner = nullptr;
+			mb->next = blocks;
+			blocks = mb;
+			return true;
+		}
+
+		// Take a pooled block, null if none
+		mblock *take()
+		{
+			lock_guard<mutex> lg(m);
+			mblock *mb = blocks;
+			if ( mb )
+			{
+				blocks = mb->next;
+				count--;
+			}
+			return mb;
+		}
+	};
+
+	////////////////////////////
+	// Coroutine frame prefix //
+	////////////////////////////
+
+	// Placed at the start of the object area of coroutine frame blocks, before the frame.
+	struct frame_prefix
+	{
+		basic_ptr members;				// Head of the doubly-linked member smart pointers list
+		basic_ptr self;					// Root attached to the frame while it is entered
+		mblock *saved;					// Frame entered before this one
+		void (*destroy)(void *fr);		// Frame destructor
+
+		frame_prefix(mblock *mb, void (*destr)(void *)) : members(basic_ptr::unlinked_t()),
+			self(basic_ptr::unlinked_t()), saved(nullptr), destroy(destr) { self.mem = mb; }
+
+		// Define the size of this structure so that the frame is maximally aligned.
+		constexpr static unsigned size() { return sizeof(aligned_storage<sizeof(frame_prefix)>::type); }
+
+		// Prefix of a block, prefix of a frame and frame address
+		static frame_prefix *of(mblock *mb) { return reinterpret_cast<frame_prefix *>(mb->obj()); }
+		static frame_prefix *at(void *addr) { return reinterpret_cast<frame_prefix *>(static_cast<char *>(addr) - size()); }
+		void *addr() { return reinterpret_cast<char *>(this) + size(); }
+
+		// Block destructor, does nothing if the frame was destroyed by its owner
+		static void destroy_frame(void *obj, unsigned nelems)
+		{
+			frame_prefix *fr = static_cast<frame_prefix *>(obj);
+			if ( nelems )
+				fr->destroy(fr->addr());
+		}
+
+		static const objtype type;
+	};
+
+	const objtype frame_prefix::type = { frame_prefix::destroy_frame, nullptr, true, false, false, false, false, nullptr, nullptr, nullptr };
 }
 
-using namespace gcptr;
+using namespace gcptr;
+
+namespace
+{
+	// Root smart pointers
+	mutex roots_m;						// Serialize the member lists of coroutine frames and the shadow stacks registry
+
+	// Root registry. Roots take slots of 4 KB chunks, which the collector scans as arrays.
+	// A thread registers its roots in its current chunk and picks another one with enough free
+	// slots, or a new one, when it is full. A root is released to the chunk it is in, whichever
+	// thread destroys it, and released slots are reused first, so that only the slots below
+	// used are ever scanned. Chunks are aligned on their size, so a slot gives its chunk.
+	const unsigned chunk_size = 4096;
+	const unsigned chunk_slots = 400;
+	struct root_chunk
+	{
+		basic_ptr *slots[chunk_slots];
+		unsigned short next_free[chunk_slots];	// Released slots list
+		mutex m;						// Serialize the members below
+		unsigned free;					// First released slot, chunk_slots if none
+		unsigned used;					// Slots taken once
+		atomic<unsigned> nfree;			// Slots available
+
+		static root_chunk *of(basic_ptr **slot)
+		{
+			return reinterpret_cast<root_chunk *>(reinterpret_cast<uintptr_t>(slot) & ~uintptr_t(chunk_size - 1));
+		}
+	};
+	static_assert(sizeof(root_chunk) <= chunk_size, "root chunk too big");
+	mutex chunks_m;						// Serialize the chunk registry
+	vector<root_chunk *> chunks;		// Chunk registry
+	unsigned chunk_cursor;				// Where to look for a chunk with free slots
+	TLS root_chunk *current_chunk;		// Chunk of the roots of this thread
+
+	// Stacks of the threads that registered roots. A forked child drops the roots on the
+	// stacks of the other threads, since it reuses them for its own threads.
+	struct stack_range
+	{
+		char *lo, *hi;
+		bool contains(const void *p) const { return p >= lo && p < hi; }
+	};
+	vector<stack_range> stacks;			// Serialized by chunks_m
+	TLS stack_range own_stack;			// Stack of this thread, null until known
+	void register_thread();
+
+	// Bounds of the stack of this thread
+	bool stack_bounds(stack_range &r)
+	{
+		pthread_attr_t attr;
+		void *addr;
+		size_t size;
+		if ( pthread_getattr_np(pthread_self(), &attr) )
+			return false;
+		pthread_attr_getstack(&attr, &addr, &size);
+		pthread_attr_destroy(&attr);
+		r.lo = static_cast<char *>(addr);
+		r.hi = r.lo + size;
+		return true;
+	}
+
+	void note_stack()
+	{
+		if ( own_stack.hi || !stack_bounds(own_stack) )
+			return;
+		lock_guard<mutex> lg(chunks_m);
+		stacks.push_back(own_stack);
+		register_thread();
+	}
+
+	// A chunk with at least a quarter of its slots free among the next few ones, else a new one
+	root_chunk *pick_chunk()
+	{
+		const unsigned probes = 8;
+		lock_guard<mutex> lg(chunks_m);
+		for ( unsigned n = 0 ; n < chunks.size() && n < probes ; n++ )
+		{
+			chunk_cursor = (chunk_cursor + 1) % chunks.size();
+			if ( chunks[chunk_cursor]->nfree >= chunk_slots / 4 )
+				return chunks[chunk_cursor];
+		}
+
+		void *mem;
+		if ( posix_memalign(&mem, chunk_size, chunk_size) )
+			throw bad_alloc();
+		root_chunk *c = new(mem) root_chunk();
+		c->free = chunk_slots;
+		c->used = 0;
+		c->nfree = chunk_slots;
+		chunks.push_back(c);
+		return c;
+	}
+
+	// Register a root in a slot. Returns the slot.
+	basic_ptr **add_root(basic_ptr *p)
+	{
+		for ( root_chunk *c = current_chunk ; ; c = current_chunk = pick_chunk() )
+		{
+			if ( !c )
+			{
+				note_stack();
+				continue;
+			}
+			lock_guard<mutex> lg(c->m);
+			if ( !c->nfree )
+				continue;
+			unsigned i = c->free;
+			if ( i < chunk_slots )
+				c->free = c->next_free[i];
+			else
+				i = c->used++;
+			c->slots[i] = p;
+			c->nfree.store(c->nfree.load(memory_order_relaxed) - 1, memory_order_relaxed);
+			return &c->slots[i];
+		}
+	}
+
+	// Release the slot of a root
+	void remove_root(basic_ptr **slot)
+	{
+		root_chunk *c = root_chunk::of(slot);
+		unsigned i = slot - c->slots;
+		lock_guard<mutex> lg(c->m);
+		*slot = nullptr;
+		c->next_free[i] = c->free;
+		c->free = i;
+		c->nfree.store(c->nfree.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	}
+
+	// Shadow stacks of root scopes, one per thread that began one. The slots in use are below
+	// top, those of the innermost scope from base to limit. Slots only hold smart pointers on
+	// the stack of the thread, which alone releases them. The collector raises scanning while
+	// it reads the slots, and a thread that releases one waits until it is lowered again, so
+	// that the smart pointer is not destroyed while it is read.
+	const unsigned max_slots = 4096;
+	struct shadow_stack
+	{
+		atomic<basic_ptr *> slots[max_slots];
+		atomic<unsigned> top;
+		atomic<bool> scanning;
+		unsigned base, limit;			// Innermost scope
+		char *lo, *hi;					// Stack of the thread
+	};
+	vector<shadow_stack *> shadow_stacks;	// Registry, serialized by roots_m
+	TLS shadow_stack *shadow;			// Shadow stack of this thread
+	char scoped_tag;					// Link of smart pointers in slots, see link()
+	basic_ptr *const scoped = reinterpret_cast<basic_ptr *>(&scoped_tag);
+
+	// Call f for the roots, in the shadow stacks and in the chunks. Called with roots_m locked.
+	// Roots are moved from the former to the latter, see ~root_scope(), so they are scanned
+	// in this order.
+	template <typename F> void for_each_root(F f)
+	{
+		for ( auto s : shadow_stacks )
+		{
+			s->scanning = true;
+			unsigned top = s->top;
+			for ( unsigned i = 0 ; i < top ; i++ )
+				if ( basic_ptr *p = s->slots[i] )
+					f(p);
+			s->scanning = false;
+		}
+
+		lock_guard<mutex> lg(chunks_m);
+		for ( auto c : chunks )
+		{
+			lock_guard<mutex> lc(c->m);
+			for ( unsigned i = 0 ; i < c->used ; i++ )
+				if ( c->slots[i] )
+					f(c->slots[i]);
+		}
+	}
+
+	// Release a slot of the shadow stack of this thread, and pop the free slots at the top
+	// of the innermost scope.
+	void release_slot(atomic<basic_ptr *> *slot)
+	{
+		shadow_stack *s = shadow;
+		slot->store(nullptr);
+		while ( s->scanning )
+			this_thread::yield();
+		unsigned top = s->top.load(memory_order_relaxed);
+		while ( top > s->base && !s->slots[top - 1].load(memory_order_relaxed) )
+			top--;
+		s->top.store(top, memory_order_release);
+	}
+	
+	// Memory block globals
+	mutex active_m;						// Serialize the active blocks list
+	mblock *active_blocks;				// Active blocks
+	mblock *noscan_blocks;				// Active blocks of pointer-free objects (no-scan space)
+	atomic<mblock *> published;			// Blocks activated since the last collection
+	TLS mblock *constr_stack;			// Thread-local construction stack
+	TLS mblock *new_blocks;				// Thread-local new blocks list
+	TLS mblock *running_frame;			// Thread-local entered coroutine frame
+
+	// Sweeping globals
+	sweep_mode smode = sweep_eager;		// Sweep mode
+	unsigned assist_ratio = 2;			// Garbage swept per allocated byte
+	mutex sweep_m;						// Serialize the unswept list
+	condition_variable *sweep_cv = new condition_variable;	// Garbage queued for the sweeper
+	mblock *unswept;					// Garbage waiting to be swept
+	atomic<unsigned> unswept_bytes;		// Object memory in the unswept list
+	TLS bool sweeping;					// This thread is sweeping
+
+	// Blocks of the types that need finalization, destroyed by the fast exit. A block is
+	// destroyed by whoever takes it from the registry.
+	mutex final_m;						// Serialize the registry
+	set<mblock *> finalizable;
+
+	// Remove a block from the registry. Returns false if the fast exit took it.
+	bool unregister_final(mblock *mb)
+	{
+		lock_guard<mutex> lg(final_m);
+		return finalizable.erase(mb);
+	}
+
+	// Thread-private heaps
+	mutex heaps_m;						// Serialize the heaps registry
+	vector<local_heap *> heaps;			// Heaps of the threads with private allocation
+	atomic<unsigned> private_threads;	// Size of the registry
+	TLS local_heap *private_heap;		// Heap of this thread, null if not enabled
+	TLS local_heap *marking_heap;		// Heap being marked by this thread, null for shared blocks
+	TLS vector<mblock *> *visited;		// Blocks collected by the visitor instead of marked
+
+	// Compaction
+	typedef unordered_map<mblock *, mblock *> forwarding;
+	TLS forwarding *forwarded;			// New addresses of moved blocks, used by the visitor
+
+	// Trace guards. Threads that run trace() methods on objects of other threads exclude the
+	// threads holding guards: they set tracing, then wait for the guards of other threads to
+	// be released. A thread entering a guard while tracing is set backs off until it is
+	// cleared. Atomics only, so that a forked child can reset them.
+	atomic<bool> tracing;				// Some thread excludes the guards
+	atomic<unsigned> guards;			// Guards held by all threads
+	TLS unsigned own_guards;			// Guards held by this thread
+	TLS unsigned excluding;				// Exclusion depth of this thread
+
+	// Exclude the threads holding trace guards, or nest in the exclusion of this thread. Never
+	// called by a thread holding a guard, which would wait for threads that may wait for it.
+	void exclude_tracing()
+	{
+		if ( excluding++ )
+			return;
+		bool expected = false;
+		while ( !tracing.compare_exchange_weak(expected, true) )
+		{
+			expected = false;
+			this_thread::yield();
+		}
+		while ( guards )
+			this_thread::yield();
+	}
+
+	void end_exclusion()
+	{
+		if ( !--excluding )
+			tracing = false;
+	}
+
+	struct trace_exclusion
+	{
+		trace_exclusion() { exclude_tracing(); }
+		~trace_exclusion() { end_exclusion(); }
+	};
+
+	// Thread exit. A thread that takes memory of its own (regions, a placement window, a shadow
+	// stack) or a private heap registers for thread_exit() to give them back when it exits.
+	void thread_exit(void *);
+	TLS bool registered;				// This thread is registered
+
+	void register_thread()
+	{
+		struct exit_key
+		{
+			pthread_key_t key;
+			exit_key() { pthread_key_create(&key, thread_exit); }
+		};
+		static exit_key k;
+
+		if ( registered )
+			return;
+		registered = true;
+		pthread_setspecific(k.key, &registered);	// Any value but null
+	}
+
+	// Heap of the private block that contains an address, if private to this thread
+	local_heap *owner_of(void *addr)
+	{
+		for ( mblock *mb = constr_stack ; mb ; mb = mb->next )
+			if ( mb->contains(addr) )
+				return mb->owner;
+		for ( mblock *mb = new_blocks ; mb ; mb = mb->next )
+			if ( mb->contains(addr) )
+				return mb->owner;
+
+		local_heap *h = private_heap;
+		if ( !h )
+			return nullptr;
+		lock_guard<mutex> lg(h->m);
+		auto i = h->blocks.upper_bound(static_cast<mblock *>(addr));
+		if ( i == h->blocks.begin() || !(*--i)->contains(addr) )
+			return nullptr;
+		return h;
+	}
+
+	// Blocks shaded by atomic_ptr operations while the collector is marking
+	mutex gray_m;						// Serialize the gray list
+	atomic<bool> marking;				// Collector is in the mark phase
+	vector<mblock *> gray;				// Blocks to be marked before sweeping
+
+	// Hand a block to the collector if it is marking
+	inline void shade(mblock *mb)
+	{
+		if ( !mb || !marking )
+			return;
+		lock_guard<mutex> lg(gray_m);
+		if ( marking )
+			gray.push_back(mb);
+	}
+
+	// An atomic_ptr operation in progress. When the mark phase begins, the collector waits
+	// for those that may have missed the marking flag, so that it sees the smart pointers
+	// they write.
+	atomic<unsigned> in_flight;			// Operations in progress
+
+	struct atomic_op
+	{
+		atomic_op() { in_flight++; }
+		~atomic_op() { in_flight--; }
+	};
+
+	// Reserved heap range. Blocks are allocated in size classes: multiples of 16 bytes up to
+	// 4 KB, powers of two above. Each class has a free list linked through the first word of
+	// the free chunks, and new chunks are taken from the top of the range.
+	const unsigned small_max = 4096;
+	const unsigned nclasses = small_max / 16 + 8 * sizeof(size_t);
+	mutex heap_m;						// Serialize the range allocator
+	char *heap_base;					// Reserved range, null if not reserved
+	char *heap_top;						// Start of never allocated memory
+	char *heap_end;						// End of the range
+	void *free_chunks[nclasses];		// Free lists
+	size_t free_bytes;					// Memory in the free lists
+
+	// Mark bits. They are in the block headers, unless heap_fork_friendly() moved them to a
+	// bitmap of the reserved range, with a bit per 16 bytes.
+	atomic<unsigned long long> *mark_bits;	// Bitmap, null if in the headers
+
+	inline bool is_marked(mblock *mb)
+	{
+		if ( !mark_bits )
+			return mb->marked;
+		size_t i = (reinterpret_cast<char *>(mb) - heap_base) / 16;
+		return mark_bits[i / 64].load(memory_order_relaxed) >> (i % 64) & 1;
+	}
+
+	inline void set_marked(mblock *mb, bool marked)
+	{
+		if ( !mark_bits )
+		{
+			mb->marked = marked;
+			return;
+		}
+		size_t i = (reinterpret_cast<char *>(mb) - heap_base) / 16;
+		unsigned long long bit = 1ull << (i % 64);
+		if ( marked )
+			mark_bits[i / 64].fetch_or(bit, memory_order_relaxed);
+		else
+			mark_bits[i / 64].fetch_and(~bit, memory_order_relaxed);
+	}
+
+	// Size class of a block, and size of its chunks
+	unsigned size_class(size_t size, size_t &chunk)
+	{
+		if ( size <= small_max )
+		{
+			unsigned c = (size + 15) / 16;
+			chunk = c * 16;
+			return c;
+		}
+		unsigned lg = 8 * sizeof(unsigned long long) - __builtin_clzll(size - 1);
+		chunk = size_t(1) << lg;
+		return small_max / 16 + lg - 12;
+	}
+
+	// Put free memory on the free lists, or take the chunk after link. Called with heap_m
+	// locked. Free memory, a multiple of 16 bytes, goes as chunks of the biggest classes that
+	// fit in it: leftovers of alignment are rounded down, never up.
+	inline void free_chunk(void *p, size_t size)
+	{
+		char *q = static_cast<char *>(p);
+		while ( size >= 16 )
+		{
+			size_t chunk = size <= small_max ? size / 16 * 16 : size_t(1) << (63 - __builtin_clzll(size));
+			unsigned c = size_class(chunk, chunk);
+			*reinterpret_cast<void **>(q) = free_chunks[c];
+			free_chunks[c] = q;
+			free_bytes += chunk;
+			q += chunk;
+			size -= chunk;
+		}
+	}
+
+	inline char *take_chunk(void **link, size_t chunk)
+	{
+		void *p = *link;
+		*link = *static_cast<void **>(p);
+		free_bytes -= chunk;
+		return static_cast<char *>(p);
+	}
+
+	// Mark-region heap. Blocks of at most 8 KB are bump-allocated in regions of 32 KB divided
+	// into lines of 128 bytes. Each line counts the blocks that overlap it, and is free when
+	// they have all been swept. A thread allocates in runs of free lines (holes) of a region
+	// it owns, and blocks bigger than a line that don't fit in the current hole go to a second
+	// region, so that small blocks fill the small holes. When a thread finds no hole left, it
+	// gives the region up and takes one where sweeping freed enough lines, or a new one.
+	const size_t region_size = 32 * 1024;
+	const size_t line_size = 128;
+	const unsigned nlines = region_size / line_size;
+	const size_t region_max = 8 * 1024;		// Larger blocks go to the general heap
+	const unsigned recycle_lines = nlines / 8;	// Free lines to recycle a full region
+	const unsigned recycle_tries = 8;			// Recycled regions searched for a hole
+
+	enum region_state { region_owned, region_full, region_listed };
+
+	struct region
+	{
+		atomic<unsigned char> lines[nlines];	// Blocks overlapping each line
+		atomic<unsigned> free_lines;			// Lines overlapped by no block
+		atomic<int> state;						// Owned by a thread, full or recyclable
+		region *next;							// Next recyclable region
+
+		region();
+	};
+
+	const unsigned header_lines = (sizeof(region) + line_size - 1) / line_size;
+
+	// The header lines are never free
+	region::region() : free_lines(nlines - header_lines), state(region_owned), next(nullptr)
+	{
+		for ( unsigned i = 0 ; i < nlines ; i++ )
+			lines[i] = i < header_lines;
+	}
+
+	// Region owned by a thread and its current hole
+	struct bump_area
+	{
+		region *owned;
+		char *cursor;
+		char *limit;
+	};
+
+	bool regions;						// Mark-region heap enabled
+	atomic<bool> heap_used;				// Blocks were allocated
+	mutex regions_m;					// Serialize the recyclable list
+	region *recyclable;					// Regions with enough free lines, in order
+	region **recyclable_end = &recyclable;
+	TLS bump_area small_area;			// Areas of this thread: for any block,
+	TLS bump_area medium_area;			// and for bigger blocks than a line
+	TLS bool evacuating;				// Compacting, take only new regions
+
+	inline region *region_of(const void *p)
+	{
+		return reinterpret_cast<region *>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(region_size - 1));
+	}
+
+	// Make a full region recyclable, once. Regions are taken in the order they were recycled,
+	// and those where a block did not fit are recycled again.
+	void recycle(region *r)
+	{
+		int full = region_full;
+		if ( !r->state.compare_exchange_strong(full, region_listed) )
+			return;
+		lock_guard<mutex> lg(regions_m);
+		r->next = nullptr;
+		*recyclable_end = r;
+		recyclable_end = &r->next;
+	}
+
+	// Give up a region. Lines freed while it was owned are checked after it is marked full,
+	// since only then do frees recycle it themselves.
+	void release_region(region *r)
+	{
+		r->state = region_full;
+		if ( r->free_lines >= recycle_lines )
+			recycle(r);
+	}
+
+	void release_area(bump_area &a)
+	{
+		if ( a.owned )
+			release_region(a.owned);
+		a.owned = nullptr;
+		a.cursor = a.limit = nullptr;
+	}
+
+	// Find a hole where a block fits in the region of an area, from a line
+	bool find_hole(bump_area &a, unsigned from, size_t size)
+	{
+		region *r = a.owned;
+		for ( unsigned i = from ; i < nlines ; )
+		{
+			if ( r->lines[i] )
+			{
+				i++;
+				continue;
+			}
+			unsigned j = i;
+			while ( j < nlines && !r->lines[j] )
+				j++;
+			if ( (j - i) * line_size >= size )
+			{
+				a.cursor = reinterpret_cast<char *>(r) + i * line_size;
+				a.limit = reinterpret_cast<char *>(r) + j * line_size;
+				return true;
+			}
+			i = j;
+		}
+		return false;
+	}
+
+	// Count a block on the lines it overlaps, or uncount it. Returns the number of lines that
+	// were free or became free. Inner lines are only overlapped by this block, so they are set.
+	unsigned count_lines(region *r, size_t start, size_t size, bool add)
+	{
+		unsigned first = start / line_size, last = (start + size - 1) / line_size;
+		unsigned changed = last > first + 1 ? last - first - 1 : 0;
+		for ( unsigned l = first + 1 ; l < last ; l++ )
+			r->lines[l].store(add, memory_order_relaxed);
+		for ( unsigned l : { first, last } )
+		{
+			if ( add ? r->lines[l]++ == 0 : --r->lines[l] == 0 )
+				changed++;
+			if ( last == first )
+				break;
+		}
+		return changed;
+	}
+
+	// Take a recyclable region with a hole where a block fits, or else a new region
+	void acquire_region(bump_area &a, size_t size)
+	{
+		register_thread();
+		release_area(a);
+
+		region *skipped = nullptr;
+		for ( unsigned n = 0 ; n < recycle_tries && !evacuating ; n++ )
+		{
+			region *r;
+			{
+				lock_guard<mutex> lg(regions_m);
+				if ( !(r = recyclable) )
+					break;
+				if ( !(recyclable = r->next) )
+					recyclable_end = &recyclable;
+			}
+			r->state = region_owned;
+			a.owned = r;
+			if ( find_hole(a, header_lines, size) )
+				break;
+			a.owned = nullptr;
+			r->next = skipped;
+			skipped = r;
+		}
+		while ( skipped )
+		{
+			region *r = skipped;
+			skipped = r->next;
+			release_region(r);
+		}
+		if ( a.owned )
+			return;
+
+		void *p;
+		if ( heap_base )
+		{
+			lock_guard<mutex> lg(heap_m);
+			char *start = heap_base + (heap_top - heap_base + region_size - 1) / region_size * region_size;
+			if ( region_size > size_t(heap_end - start) )
+				throw bad_alloc();
+			if ( start > heap_top )
+				free_chunk(heap_top, start - heap_top);
+			p = start;
+			heap_top = start + region_size;
+		}
+		else if ( posix_memalign(&p, region_size, region_size) )
+			throw bad_alloc();
+		a.owned = new(p) region();
+		find_hole(a, header_lines, size);
+	}
+
+	// Allocate a block in the current hole of the small area. Otherwise, blocks bigger than a
+	// line go to the medium area, and others to the next hole of the small area.
+	char *region_alloc(size_t size)
+	{
+		size = (size + 15) / 16 * 16;
+		bump_area *a = &small_area;
+		if ( size > size_t(a->limit - a->cursor) )
+		{
+			if ( size > line_size )
+				a = &medium_area;
+			if ( size > size_t(a->limit - a->cursor) )
+			{
+				unsigned next = a->owned ? (a->limit - reinterpret_cast<char *>(a->owned)) / line_size : nlines;
+				if ( !a->owned || !find_hole(*a, next, size) )
+					acquire_region(*a, size);
+			}
+		}
+		char *p = a->cursor;
+		a->cursor += size;
+		region *r = a->owned;
+		r->free_lines -= count_lines(r, p - reinterpret_cast<char *>(r), size, true);
+		return p;
+	}
+
+	// Is a block in a region where at least half the lines are free?
+	inline bool fragmented(mblock *mb)
+	{
+		return mblock::size() + mb->objsize <= region_max && region_of(mb)->free_lines >= (nlines - header_lines) / 2;
+	}
+
+	// Free a block, and recycle its region if enough lines are free
+	void region_free(void *p, size_t size)
+	{
+		size = (size + 15) / 16 * 16;
+		region *r = region_of(p);
+		unsigned freed = count_lines(r, static_cast<char *>(p) - reinterpret_cast<char *>(r), size, false);
+		if ( freed && (r->free_lines += freed) >= recycle_lines && r->state == region_full )
+			recycle(r);
+	}
+
+	// Allocate block memory, in the reserved range if any. Fresh memory from the top of the
+	// range is preferred to free chunks if asked, so that successive blocks are adjacent.
+	char *heap_alloc(size_t size, bool fresh = false)
+	{
+		if ( !heap_used )
+			heap_used = true;
+		if ( regions && size <= region_max )
+			return region_alloc(size);
+		if ( !heap_base )
+			return new char[size];
+
+		size_t chunk;
+		unsigned c = size_class(size, chunk);
+		lock_guard<mutex> lg(heap_m);
+		if ( free_chunks[c] && !(fresh && chunk <= size_t(heap_end - heap_top)) )
+			return take_chunk(&free_chunks[c], chunk);
+		if ( chunk > size_t(heap_end - heap_top) )
+			throw bad_alloc();
+		char *top = heap_top;
+		heap_top += chunk;
+		return top;
+	}
+
+	// Placement near other blocks. A block is placed in a free chunk of the same page as the
+	// given block, found among the first entries of its free list, or else in a window of the
+	// range owned by this thread, where blocks allocated in a row are adjacent. New windows are
+	// taken from the top of the range, unless the free lists hold much memory to be reused.
+	const size_t page_size = 4096;
+	const unsigned near_search = 64;	// Free list entries searched
+	TLS char *window_top;				// Window of this thread
+	TLS char *window_end;
+
+	char *heap_alloc_near(size_t size, const void *near)
+	{
+		if ( !heap_base || regions || size > small_max )
+			return heap_alloc(size);
+
+		size_t chunk;
+		unsigned c = size_class(size, chunk);
+		if ( chunk > size_t(window_end - window_top) || (near >= heap_base && near < heap_end) )
+		{
+			lock_guard<mutex> lg(heap_m);
+
+			// A free chunk in the same page
+			if ( near >= heap_base && near < heap_end )
+			{
+				uintptr_t page = reinterpret_cast<uintptr_t>(near) / page_size;
+				void **link = &free_chunks[c];
+				for ( unsigned i = 0 ; *link && i < near_search ; i++, link = static_cast<void **>(*link) )
+					if ( reinterpret_cast<uintptr_t>(*link) / page_size == page )
+						return take_chunk(link, chunk);
+			}
+
+			// A new window aligned to a page. Leftovers go to the free lists.
+			if ( chunk > size_t(window_end - window_top) )
+			{
+				char *start = heap_base + (heap_top - heap_base + page_size - 1) / page_size * page_size;
+				if ( free_bytes > size_t(heap_top - heap_base) / 4 || page_size > size_t(heap_end - start) )
+				{
+					if ( free_chunks[c] )
+						return take_chunk(&free_chunks[c], chunk);
+					if ( chunk > size_t(heap_end - heap_top) )
+						throw bad_alloc();
+					char *top = heap_top;
+					heap_top += chunk;
+					return top;
+				}
+				if ( start > heap_top )
+					free_chunk(heap_top, start - heap_top);
+				if ( window_top < window_end )
+					free_chunk(window_top, window_end - window_top);
+				register_thread();
+				window_top = start;
+				window_end = heap_top = start + page_size;
+			}
+		}
+
+		// The window belongs to this thread
+		char *p = window_top;
+		window_top += chunk;
+		return p;
+	}
+
+	// Free block memory
+	void heap_free(void *p, size_t size)
+	{
+		if ( regions && size <= region_max )
+		{
+			region_free(p, size);
+			return;
+		}
+		if ( p < heap_base || p >= heap_end )
+		{
+			delete[] static_cast<char *>(p);
+			return;
+		}
+
+		size_t chunk;
+		size_class(size, chunk);
+		lock_guard<mutex> lg(heap_m);
+		free_chunk(p, chunk);
+	}
+
+	// Slab cache of a type, created by the first allocation
+	const size_t slab_size = 16 * 1024;	// Minimum slab size
+	mutex slabs_m;						// Serialize the creation of slab caches
+	vector<slab_cache *> slab_caches;	// All caches
+
+	// Recycle pool of a type, created by the first sweep of one of its objects
+	mutex pools_m;							// Serialize the creation of recycle pools
+	vector<recycle_pool *> recycle_pools;	// All pools
+
+	// Recycle pool of a type, created by the first sweep of one of its objects. The release
+	// store publishes the initialized pool to the acquire loads of other threads.
+	recycle_pool *pool_of(const objtype &type)
+	{
+		if ( recycle_pool *p = __atomic_load_n(&type.pool, __ATOMIC_ACQUIRE) )
+			return p;
+		lock_guard<mutex> lg(pools_m);
+		recycle_pool *p = __atomic_load_n(&type.pool, __ATOMIC_RELAXED);
+		if ( !p )
+		{
+			p = new recycle_pool();
+			recycle_pools.push_back(p);
+			__atomic_store_n(&type.pool, p, __ATOMIC_RELEASE);
+		}
+		return p;
+	}
+
+	// Keep a swept single object of a recycled type in the pool of its type. Returns false if
+	// it must be destroyed.
+	bool recycle(mblock *mb)
+	{
+		return mb->type->reset && mb->nelems == 1 && !exiting && pool_of(*mb->type)->put(mb);
+	}
+
+	// Slab cache of a type, created by the first allocation. The release store publishes the
+	// initialized cache to the acquire loads of other threads.
+	slab_cache *slabs_of(const objtype &type, unsigned objsize)
+	{
+		if ( slab_cache *c = __atomic_load_n(&type.slabs, __ATOMIC_ACQUIRE) )
+			return c;
+		lock_guard<mutex> lg(slabs_m);
+		slab_cache *c = __atomic_load_n(&type.slabs, __ATOMIC_RELAXED);
+		if ( !c )
+		{
+			c = new slab_cache(objsize);
+			slab_caches.push_back(c);
+			__atomic_store_n(&type.slabs, c, __ATOMIC_RELEASE);
+		}
+		return c;
+	}
+
+	// Allocate a slot: a free one, or else the next one of the last slab
+	char *slab_alloc(slab_cache *c)
+	{
+		lock_guard<mutex> lg(c->m);
+		if ( c->free )
+		{
+			void *p = c->free;
+			c->free = *static_cast<void **>(p);
+			return static_cast<char *>(p);
+		}
+		if ( c->top == c->end )
+		{
+			size_t n = max(slab_size / c->slot, size_t(1));
+			c->top = heap_alloc(n * c->slot);
+			c->end = c->top + n * c->slot;
+		}
+		char *p = c->top;
+		c->top += c->slot;
+		return p;
+	}
+
+	// Slab cache of a block, if it is a slot. A slot was carved after its cache was published,
+	// so a relaxed load suffices.
+	inline slab_cache *slab_of(mblock *mb)
+	{
+		slab_cache *c = __atomic_load_n(&mb->type->slabs, __ATOMIC_RELAXED);
+		return c && mb->objsize == c->objsize ? c : nullptr;
+	}
+
+	// Free the memory of a destroyed block, giving slots back to their slab cache
+	void free_block(mblock *mb)
+	{
+		if ( slab_cache *c = slab_of(mb) )
+		{
+			lock_guard<mutex> lg(c->m);
+			*reinterpret_cast<void **>(mb) = c->free;
+			c->free = mb;
+			return;
+		}
+		heap_free(mb, mblock::size() + mb->objsize);
+	}
+
+	// Push a block at the head of a list
+	inline void push(mblock *mb, mblock *&list)
+	{
+		mb->next = list;
+		list = mb;
+	}
+
+	// Pop the block at the head of a list
+	inline mblock *pop(mblock *&list)
+	{
+		mblock *mb = list;
+		list = list->next;
+		return mb;
+	}
+
+	// Separate the unmarked blocks of an active list into the garbage list. The list is
+	// unlinked in place, so that the headers of the accessible blocks are only written
+	// where a neighbour is garbage.
+	unsigned separate(mblock *&list, mblock *&garbage)
+	{
+		unsigned bytes = 0;
+		for ( mblock **link = &list ; *link ; )
+		{
+			mblock *mb = *link;
+			if ( is_marked(mb) )
+			{
+				set_marked(mb, false);
+				link = &mb->next;
+			}
+			else
+			{
+				bytes += mb->objsize;
+				*link = mb->next;
+				push(mb, garbage);
+			}
+		}
+		return bytes;
+	}
+
+	// Move the blocks published by alloc_end() to the active lists, before marking. Marks they
+	// got while published during the previous collection are cleared. A block taken out, if
+	// given, is left out. Returns true if it was published. Called with active_m locked.
+	bool adopt_published(mblock *taken = nullptr)
+	{
+		bool found = false;
+		mblock *list = published.exchange(nullptr, memory_order_acquire);
+		while ( list )
+		{
+			mblock *mb = pop(list);
+			if ( mb == taken )
+			{
+				found = true;
+				continue;
+			}
+			set_marked(mb, false);
+			push(mb, mb->type->scan ? active_blocks : noscan_blocks);
+		}
+		return found;
+	}
+
+	// Destroy and free a garbage list. Returns amount of freed memory.
+	unsigned destroy(mblock *garbage)
+	{
+		unsigned freed = 0;
+		sweeping = true;
+		while ( garbage )
+		{
+			mblock *mb = pop(garbage);
+			if ( recycle(mb) )
+				continue;
+			if ( mb->type->finalize && !unregister_final(mb) )
+				continue;
+			freed += mb->objsize;
+			mb->~mblock();
+			free_block(mb);
+		}
+		sweeping = false;
+		return freed;
+	}
+
+	// Sweep at least the given amount of unswept garbage, or all of it if 0.
+	// Returns amount of freed memory.
+	unsigned sweep(unsigned bytes)
+	{
+		mblock *garbage = nullptr;
+		unsigned taken = 0;
+		sweep_m.lock();
+		while ( unswept && (!bytes || taken < bytes) )
+		{
+			taken += unswept->objsize;
+			push(pop(unswept), garbage);
+		}
+		unswept_bytes -= taken;
+		sweep_m.unlock();
+		return destroy(garbage);
+	}
+
+	// Add a heap to the registry, or remove it
+	void register_heap(local_heap *h)
+	{
+		heaps_m.lock();
+		heaps.push_back(h);
+		private_threads = heaps.size();
+		heaps_m.unlock();
+	}
+
+	void unregister_heap(local_heap *h)
+	{
+		heaps_m.lock();
+		heaps.erase(find(heaps.begin(), heaps.end(), h));
+		private_threads = heaps.size();
+		heaps_m.unlock();
+	}
+
+	// Make all the blocks of a heap shared
+	void release(local_heap *h)
+	{
+		unsigned bytes = 0;
+		active_m.lock();
+		h->m.lock();
+		for ( auto mb : h->blocks )
+		{
+			mb->owner = nullptr;
+			push(mb, mb->type->scan ? active_blocks : noscan_blocks);
+			bytes += mb->objsize;
+		}
+		h->blocks.clear();
+		h->m.unlock();
+		active_m.unlock();
+
+		gc_m.lock();
+		allocated += bytes;
+		if ( allocated >= threshold )
+			pending = true;
+		gc_m.unlock();
+	}
+
+	// Give back the memory of an exiting thread: the unused space of its regions and window
+	// and its shadow stack. Its private blocks become shared.
+	void thread_exit(void *)
+	{
+		if ( local_heap *h = private_heap )
+		{
+			release(h);
+			unregister_heap(h);
+			private_heap = nullptr;
+			delete h;
+		}
+
+		release_area(small_area);
+		release_area(medium_area);
+
+		if ( window_top < window_end )
+		{
+			lock_guard<mutex> lg(heap_m);
+			free_chunk(window_top, window_end - window_top);
+		}
+		window_top = window_end = nullptr;
+
+		if ( shadow_stack *s = shadow )
+		{
+			roots_m.lock();
+			shadow_stacks.erase(find(shadow_stacks.begin(), shadow_stacks.end(), s));
+			roots_m.unlock();
+			shadow = nullptr;
+			delete s;
+		}
+
+		if ( own_stack.hi )
+		{
+			chunks_m.lock();
+			stacks.erase(find_if(stacks.begin(), stacks.end(), [](const stack_range &r) { return r.lo == own_stack.lo; }));
+			chunks_m.unlock();
+			own_stack = stack_range();
+		}
+
+		current_chunk = nullptr;
+		registered = false;
+	}
+
+	// Background sweeper thread, started by the first collection in background mode and
+	// stopped at exit once the unswept list is empty.
+	struct background_sweeper
+	{
+		thread *t = nullptr;
+		bool stopping = false;
+
+		void start() { if ( !t ) t = new thread(&background_sweeper::run, this); }
+
+		void run()
+		{
+			unique_lock<mutex> lk(sweep_m);
+			for ( ;; )
+			{
+				while ( !unswept && !stopping )
+					sweep_cv->wait(lk);
+				if ( !unswept )
+					return;
+				lk.unlock();
+				sweep(64 * 1024);				// Let assisting threads take their share
+				lk.lock();
+			}
+		}
+
+		~background_sweeper()
+		{
+			if ( !t )
+				return;
+			sweep_m.lock();
+			stopping = true;
+			sweep_m.unlock();
+			sweep_cv->notify_one();
+			t->join();
+			delete t;
+		}
+	} sweeper;
+
+	// Collector thread of the real-time mode. Allocations wake it up when the threshold is
+	// reached, without waiting for its mutex; lost wakeups are caught by a timeout.
+	struct realtime_collector
+	{
+		thread *t = nullptr;
+		mutex m;
+		condition_variable *cv = new condition_variable;
+		bool stopping = false;
+
+		void start() { if ( !t ) t = new thread(&realtime_collector::run, this); }
+
+		void stop()
+		{
+			if ( !t )
+				return;
+			m.lock();
+			stopping = true;
+			m.unlock();
+			cv->notify_one();
+			t->join();
+			delete t;
+			t = nullptr;
+			stopping = false;
+		}
+
+		void run()
+		{
+			unique_lock<mutex> lk(m);
+			while ( !stopping )
+			{
+				if ( !pending )
+				{
+					cv->wait_for(lk, chrono::milliseconds(10));
+					continue;
+				}
+				lk.unlock();
+				basic_ptr::gc(false);
+				lk.lock();
+			}
+		}
+
+		~realtime_collector() { stop(); }
+	} collector;
+
+	// Fork. All the mutexes are locked before, in the lock order, so that no other thread holds
+	// one while the process is copied, and unlocked after. The child has only the forking
+	// thread, which unlocks them as their owner: they are plain mutexes, or recursive_locks,
+	// which know it by a thread::id that fork keeps. The condition variables and the thread
+	// objects of the sweeper and collector, which may refer to threads absent from the child,
+	// are abandoned rather than reset: the child allocates new condition variables and starts
+	// new threads on demand. The private heaps, shadow stacks and stack roots of the other
+	// threads are given up, as if they had exited.
+	void fork_prepare()
+	{
+		cycle_m.lock();
+		gc_m.lock();
+		active_m.lock();
+		roots_m.lock();
+		chunks_m.lock();
+		for ( auto c : chunks )
+			c->m.lock();
+		heaps_m.lock();
+		for ( auto h : heaps )
+			h->m.lock();
+		gray_m.lock();
+		sweep_m.lock();
+		slabs_m.lock();
+		for ( auto c : slab_caches )
+			c->m.lock();
+		pools_m.lock();
+		for ( auto p : recycle_pools )
+			p->m.lock();
+		heap_m.lock();
+		regions_m.lock();
+		collector.m.lock();
+		final_m.lock();
+#if GC_DEBUG
+		debug_m.lock();
+#endif
+	}
+
+	void fork_parent()
+	{
+#if GC_DEBUG
+		debug_m.unlock();
+#endif
+		final_m.unlock();
+		collector.m.unlock();
+		regions_m.unlock();
+		heap_m.unlock();
+		for ( auto p : recycle_pools )
+			p->m.unlock();
+		pools_m.unlock();
+		for ( auto c : slab_caches )
+			c->m.unlock();
+		slabs_m.unlock();
+		sweep_m.unlock();
+		gray_m.unlock();
+		for ( auto h : heaps )
+			h->m.unlock();
+		heaps_m.unlock();
+		for ( auto c : chunks )
+			c->m.unlock();
+		chunks_m.unlock();
+		roots_m.unlock();
+		active_m.unlock();
+		gc_m.unlock();
+		cycle_m.unlock();
+	}
+
+	void fork_child()
+	{
+		fork_parent();
+		sweep_cv = new condition_variable;
+		collector.cv = new condition_variable;
+		sweeper.t = nullptr;
+		collector.t = nullptr;
+		in_flight = 0;
+		tracing = excluding != 0;
+		guards = own_guards;
+
+		vector<local_heap *> others;
+		heaps_m.lock();
+		for ( auto h : heaps )
+			if ( h != private_heap )
+				others.push_back(h);
+		heaps_m.unlock();
+		for ( auto h : others )
+		{
+			release(h);
+			unregister_heap(h);
+			delete h;
+		}
+		roots_m.lock();
+		for ( auto s : shadow_stacks )
+			if ( s != shadow )
+				delete s;
+		shadow_stacks.assign(shadow ? 1 : 0, shadow);
+		roots_m.unlock();
+
+		for ( auto c : chunks )
+			for ( unsigned i = 0 ; i < c->used ; i++ )
+				for ( auto &r : stacks )
+					if ( c->slots[i] && r.lo != own_stack.lo && r.contains(c->slots[i]) )
+						remove_root(&c->slots[i]);
+		stacks.assign(own_stack.hi ? 1 : 0, own_stack);
+
+		if ( realtime )
+			collector.start();
+	}
+
+	struct fork_handlers
+	{
+		fork_handlers() { pthread_atfork(fork_prepare, fork_parent, fork_child); }
+	} fork_handlers_installed;
+
+	// Fast exit, run by atexit() once enabled. Collections are turned off, the garbage waiting
+	// to be swept is dropped, and the registered blocks are destroyed, whether accessible or
+	// not. Memory is left to the system.
+	bool fast;							// Fast exit enabled
+
+	void exit_fast()
+	{
+		if ( !fast )
+			return;
+
+		set<mblock *> final;
+		{
+			lock_guard<recursive_lock> lc(cycle_m);
+			lock_guard<recursive_lock> lg(gc_m);
+			exiting = true;
+			sweep_m.lock();
+			unswept = nullptr;
+			unswept_bytes = 0;
+			sweep_m.unlock();
+			lock_guard<mutex> lf(final_m);
+			final.swap(finalizable);
+		}
+
+		for ( auto mb : final )
+			mb->~mblock();
+		debug(final.size() << " blocks finalized at exit");
+	}
+}
+
+namespace gcptr
+{
+	/////////////////////
+	// Class basic_ptr //
+	/////////////////////
+
+	// Attachment 
+	bool basic_ptr::attach(const basic_ptr &p)
+	{
+		if ( marking )						// Snapshot barrier, see operator =
+		{
+			shade(mem);
+			shade(p.mem);
+		}
+		mem = p.mem;
+		escape();
+		return mem != nullptr;
+	}
+	bool basic_ptr::attach() { return (mem = constr_stack) != nullptr; }
+	bool basic_ptr::is_attached() const { return mem != nullptr; }
+	void basic_ptr::detach()
+	{
+		shade(mem);
+		mem = nullptr;
+	}
+
+	// Garbage collector
+	unsigned basic_ptr::gc(bool unconditional)
+	{
+		static bool busy;
+
+		if ( own_guards )			// Left pending, see trace_guard
+			return 0;
+		if ( realtime )
+			return gc_incremental(unconditional);
+
+		// Exclude other threads, and the threads holding trace guards. Destructors run by the
+		// sweep may collect again, so both are held to the end.
+		trace_exclusion te;
+		lock_guard<recursive_lock> lg(gc_m);
+
+		// Check if we should collect
+		if ( busy || exiting || (!unconditional && allocated < threshold) )
+			return 0;
+
+		busy = true;				// Don't re-enter in same thread
+		allocated = 0;
+		pending = false;
+		overdue = false;
+
+		// Finish sweeping the previous garbage
+		unsigned freed = unswept_bytes ? sweep(0) : 0;
+
+		// Mark accessible blocks. Blocks published meanwhile are left for the next collection.
+		active_m.lock();
+		adopt_published();
+		marking = true;
+		while ( in_flight )
+			this_thread::yield();
+		roots_m.lock();
+		vector<mblock *> root_blocks;
+		for_each_root([&](basic_ptr *p) { root_blocks.push_back(p->mem); });
+		roots_m.unlock();
+		for ( auto mb : root_blocks )
+			mark(mb);
+
+		// Thread-private blocks are roots of the shared blocks. The blocks they refer to are
+		// listed first, as marking them may lock roots_m (see scan()).
+		root_blocks.clear();
+		visited = &root_blocks;
+		heaps_m.lock();
+		for ( auto h : heaps )
+		{
+			h->m.lock();
+			for ( auto mb : h->blocks )
+			{
+				if ( !mb->type->scan )
+					continue;
+				for ( basic_ptr *p = mb->members ; p ; p = p->next )
+					root_blocks.push_back(p->mem);
+				if ( mb->type->trace )
+				{
+					visitor v;
+					mb->type->trace(mb->obj(), mb->nelems, v);
+				}
+			}
+			h->m.unlock();
+		}
+		heaps_m.unlock();
+		visited = nullptr;
+		for ( auto mb : root_blocks )
+			mark(mb);
+
+		// Mark blocks shaded by atomic_ptr operations until there are no more
+		for ( ;; )
+		{
+			vector<mblock *> shaded;
+			gray_m.lock();
+			shaded.swap(gray);
+			if ( shaded.empty() )
+				marking = false;
+			gray_m.unlock();
+			if ( shaded.empty() )
+				break;
+			for ( auto mb : shaded )
+				mark(mb);
+		}
+
+		// Check the active blocks of both spaces and separate garbage
+		mblock *garbage = nullptr;
+		unsigned found = separate(active_blocks, garbage) + separate(noscan_blocks, garbage);
+		active_m.unlock();
+
+		// Collect garbage, or leave it to allocating threads and the background sweeper
+		if ( smode != sweep_eager )
+		{
+			sweep_m.lock();
+			while ( garbage )
+				push(pop(garbage), unswept);
+			unswept_bytes += found;
+			sweep_m.unlock();
+			if ( smode == sweep_background )
+			{
+				sweeper.start();
+				sweep_cv->notify_one();
+			}
+			debug(found << " bytes of garbage");
+			busy = false;
+			return found;
+		}
+
+		freed += destroy(garbage);
+		debug(freed << " bytes freed");
+
+		busy = false;
+		return freed;
+	}
+
+	// Garbage collection, mark phase.
+	void basic_ptr::mark(basic_ptr *list)
+	{ 
+		for ( ; list ; list = list->next )
+			mark(list->mem);
+	}
+
+	// Mark a block and the blocks accessible from its members and traced smart pointers.
+	// Only the blocks of the heap being marked are considered: shared or private to this thread.
+	inline void basic_ptr::mark(mblock *mb)
+	{
+		if ( !mb || !mb->active || is_marked(mb) || mb->owner != marking_heap )
+			return;
+
+		set_marked(mb, true);
+		scan(mb);
+	}
+
+	// Mark the blocks accessible from the members and traced smart pointers of a block.
+	void basic_ptr::scan(mblock *mb)
+	{
+		if ( !mb->type->scan )				// No-scan blocks have no members
+			return;
+
+		if ( mb->type == &frame_prefix::type )		// Members come and go under roots_m
+		{
+			vector<mblock *> members;
+			roots_m.lock();
+			for ( basic_ptr *p = mb->members ; p ; p = p->next )
+				members.push_back(p->mem);
+			roots_m.unlock();
+			for ( auto m : members )
+				mark(m);
+		}
+		else
+			mark(mb->members);
+		if ( mb->type->trace )
+		{
+			visitor v;
+			mb->type->trace(mb->obj(), mb->nelems, v);
+		}
+	}
+
+	// Real-time collection, run by the collector thread. The active lists are set aside as the
+	// condemned blocks, and the blocks activated meanwhile go to new lists. Locks are only held
+	// to copy the roots and the blocks the private blocks refer to onto the mark stack, and to
+	// move lists. Marking then proceeds while the other threads run, kept correct by the
+	// snapshot barrier, and the unmarked condemned blocks are garbage.
+	unsigned basic_ptr::gc_incremental(bool unconditional)
+	{
+		lock_guard<recursive_lock> lc(cycle_m);
+
+		// Check if we should collect
+		gc_m.lock();
+		if ( exiting || (!unconditional && allocated < threshold) )
+		{
+			gc_m.unlock();
+			return 0;
+		}
+		allocated = 0;
+		pending = false;
+		overdue = false;
+		gc_m.unlock();
+
+		// Finish sweeping the garbage of collections before this mode
+		if ( unswept_bytes )
+			sweep(0);
+
+		// Set the active blocks aside and start marking
+		mblock *condemned = nullptr, *condemned_noscan = nullptr;
+		vector<mblock *> stack;
+		active_m.lock();
+		adopt_published();
+		marking = true;
+		swap(condemned, active_blocks);
+		swap(condemned_noscan, noscan_blocks);
+		active_m.unlock();
+		while ( in_flight )
+			this_thread::yield();
+
+		// Copy the roots, and the blocks the private blocks refer to
+		roots_m.lock();
+		for_each_root([&](basic_ptr *p) { stack.push_back(p->mem); });
+		roots_m.unlock();
+		visited = &stack;
+		exclude_tracing();
+		heaps_m.lock();
+		for ( auto h : heaps )
+		{
+			lock_guard<mutex> lg(h->m);
+			for ( auto mb : h->blocks )
+			{
+				if ( !mb->type->scan )
+					continue;
+				for ( basic_ptr *p = mb->members ; p ; p = p->next )
+					stack.push_back(p->mem);
+				if ( mb->type->trace )
+				{
+					visitor v;
+					mb->type->trace(mb->obj(), mb->nelems, v);
+				}
+			}
+		}
+		heaps_m.unlock();
+		end_exclusion();
+
+		// Mark, then mark the shaded blocks until there are no more
+		for ( ;; )
+		{
+			while ( !stack.empty() )
+			{
+				mblock *mb = stack.back();
+				stack.pop_back();
+				if ( !mb || !mb->active || is_marked(mb) || mb->owner )
+					continue;
+				set_marked(mb, true);
+				if ( !mb->type->scan )
+					continue;
+
+				bool frame = mb->type == &frame_prefix::type;	// Members list may change
+				if ( frame )
+					roots_m.lock();
+				for ( basic_ptr *p = mb->members ; p ; p = p->next )
+					stack.push_back(p->mem);
+				if ( frame )
+					roots_m.unlock();
+				if ( mb->type->trace )
+				{
+					trace_exclusion te;				// Briefly, the other threads run
+					visitor v;
+					mb->type->trace(mb->obj(), mb->nelems, v);
+				}
+			}
+
+			lock_guard<mutex> lg(gray_m);
+			if ( gray.empty() )
+			{
+				marking = false;
+				break;
+			}
+			stack.swap(gray);
+		}
+		visited = nullptr;
+
+		// Separate garbage, and unmark the blocks activated meanwhile. The lists are put back
+		// in front of the active lists.
+		mblock *garbage = nullptr;
+		separate(condemned, garbage);
+		separate(condemned_noscan, garbage);
+		active_m.lock();
+		mblock *fresh = active_blocks, *fresh_noscan = noscan_blocks;
+		active_blocks = noscan_blocks = nullptr;
+		active_m.unlock();
+		auto append = [](mblock *&list, mblock *more)
+		{
+			mblock **link = &list;
+			for ( ; *link ; link = &(*link)->next )
+				set_marked(*link, false);
+			for ( *link = more ; *link ; link = &(*link)->next )
+				;
+			return link;
+		};
+		mblock **tail = append(fresh, condemned);
+		mblock **tail_noscan = append(fresh_noscan, condemned_noscan);
+		active_m.lock();
+		*tail = active_blocks;
+		active_blocks = fresh;
+		*tail_noscan = noscan_blocks;
+		noscan_blocks = fresh_noscan;
+		active_m.unlock();
+
+		// Collect garbage
+		unsigned freed = destroy(garbage);
+		debug(freed << " bytes freed");
+		return freed;
+	}
+
+	// Private garbage collector. Other threads' roots don't refer to private blocks of this
+	// thread, and shared blocks don't either, so marking from the roots is enough.
+	unsigned basic_ptr::gc_private()
+	{
+		local_heap *h = private_heap;
+		if ( !h || exiting )
+			return 0;
+		h->allocated = 0;
+
+		// Mark accessible private blocks
+		roots_m.lock();
+		h->m.lock();
+		marking_heap = h;
+		vector<mblock *> root_blocks;
+		for_each_root([&](basic_ptr *p) { root_blocks.push_back(p->mem); });
+		for ( auto mb : root_blocks )
+			mark(mb);
+
+		// Blocks in construction and their finished nested blocks are not active yet, but
+		// their members are roots too. trace() may not be callable in a constructor.
+		for ( mblock *mb = constr_stack ; mb ; mb = mb->next )
+			if ( mb->type->scan )
+				mark(mb->members);
+		for ( mblock *mb = new_blocks ; mb ; mb = mb->next )
+			scan(mb);
+		marking_heap = nullptr;
+		roots_m.unlock();
+
+		// Separate garbage
+		mblock *garbage = nullptr;
+		for ( auto i = h->blocks.begin() ; i != h->blocks.end() ; )
+		{
+			mblock *mb = *i;
+			if ( is_marked(mb) )
+			{
+				set_marked(mb, false);
+				++i;
+			}
+			else
+			{
+				i = h->blocks.erase(i);
+				push(mb, garbage);
+			}
+		}
+		h->m.unlock();
+
+		// Collect garbage
+		unsigned freed = destroy(garbage);
+		debug(freed << " private bytes freed");
+		return freed;
+	}
+
+	// Make a private block shared, with the private blocks accessible from it.
+	void basic_ptr::promote(mblock *mb)
+	{
+		local_heap *h = mb ? mb->owner : nullptr;
+		if ( !h )
+			return;
+
+		vector<mblock *> work(1, mb);
+		unsigned bytes = 0;
+		active_m.lock();
+		h->m.lock();
+		visited = &work;
+		while ( !work.empty() )
+		{
+			mb = work.back();
+			work.pop_back();
+			if ( !mb || mb->owner != h )
+				continue;
+
+			mb->owner = nullptr;
+			if ( mb->active )				// Blocks in construction are activated as shared
+			{
+				h->blocks.erase(mb);
+				push(mb, mb->type->scan ? active_blocks : noscan_blocks);
+				bytes += mb->objsize;
+			}
+			if ( !mb->type->scan )
+				continue;
+
+			for ( basic_ptr *p = mb->members ; p ; p = p->next )
+				work.push_back(p->mem);
+			if ( mb->type->trace )
+			{
+				visitor v;
+				mb->type->trace(mb->obj(), mb->nelems, v);
+			}
+		}
+		visited = nullptr;
+		h->m.unlock();
+		active_m.unlock();
+
+		gc_m.lock();
+		allocated += bytes;
+		if ( allocated >= threshold )
+			pending = true;
+		gc_m.unlock();
+	}
+
+	// Write barrier: this has been attached to a private block. Unless this is a root or lies
+	// in a private block of the same thread, that block escapes.
+	inline void basic_ptr::escape()
+	{
+		if ( !private_threads.load(memory_order_relaxed) || !mem || !mem->owner )
+			return;
+		if ( prev != this && !(running_frame && running_frame->contains(this)) )	// A root
+			return;
+		if ( owner_of(this) != mem->owner )
+			promote(mem);
+	}
+
+	void basic_ptr::share() const { promote(mem); }
+
+	// Early free. This is detached once no global collection can run, under roots_m, which
+	// private collections hold while they read the blocks of the roots. The block is then taken
+	// out of the heap of this thread, or out of the published blocks if recent; a shared block
+	// already in the active lists is left to the collector. It is destroyed once the locks are
+	// released, so that destructors may dispose of other blocks.
+	bool basic_ptr::dispose()
+	{
+		mblock *mb = mem;
+#if GC_DEBUG
+		void *pv = pval;
+#endif
+		if ( !mb )
+			return false;
+
+		{
+			unique_lock<recursive_lock> lc(cycle_m, defer_lock);
+			if ( sweeping || (realtime && !lc.try_lock()) )	// Don't wait for the collector
+			{
+				detach();
+				pval = nullptr;
+				return false;
+			}
+#if GC_DEBUG
+			if ( own_guards )						// The check below can't wait for tracing
+			{
+				detach();
+				pval = nullptr;
+				return false;
+			}
+			trace_exclusion te;
+#endif
+			lock_guard<recursive_lock> lg(gc_m);
+			roots_m.lock();							// Private collections mark from all roots
+			mem = nullptr;
+			pval = nullptr;
+			roots_m.unlock();
+			if ( !mb->active || (mb->owner && mb->owner != private_heap) )
+				return false;
+
+#if GC_DEBUG
+			// Check that the block is not accessible from the roots, this being detached
+			bool reached = false;
+			vector<mblock *> work;
+			set<mblock *> seen;
+			active_m.lock();
+			roots_m.lock();
+			heaps_m.lock();
+			for ( auto h : heaps )
+				h->m.lock();
+			for_each_root([&](basic_ptr *p) { work.push_back(p->mem); });
+			visited = &work;
+			while ( !work.empty() && !reached )
+			{
+				mblock *b = work.back();
+				work.pop_back();
+				if ( !b || !b->active || !seen.insert(b).second )
+					continue;
+				reached = b == mb;
+				if ( !b->type->scan )
+					continue;
+				for ( basic_ptr *p = b->members ; p ; p = p->next )
+					work.push_back(p->mem);
+				if ( b->type->trace )
+				{
+					visitor v;
+					b->type->trace(b->obj(), b->nelems, v);
+				}
+			}
+			visited = nullptr;
+			for ( auto h : heaps )
+				h->m.unlock();
+			heaps_m.unlock();
+			roots_m.unlock();
+			active_m.unlock();
+			if ( reached )
+			{
+				mem = mb;
+				pval = pv;
+				throw ptr_exception("disposing of an accessible block");
+			}
+#endif
+
+			if ( local_heap *h = mb->owner )
+			{
+				lock_guard<mutex> lp(h->m);
+				h->blocks.erase(mb);
+				h->allocated -= min(h->allocated, mb->objsize);
+			}
+			else
+			{
+				// Shared blocks already in the active lists are left to the collector:
+				// unlinking them would take a walk of the heap
+				lock_guard<mutex> la(active_m);
+				if ( !adopt_published(mb) )
+					return false;
+				allocated -= min(allocated, mb->objsize);
+			}
+		}
+
+		if ( recycle(mb) )
+			return true;
+		if ( mb->type->finalize && !unregister_final(mb) )
+			return false;
+		mb->~mblock();
+		free_block(mb);
+		return true;
+	}
+
+	// Compaction. Garbage is collected first, then the accessible shared blocks are listed in
+	// depth-first order, and the relocatable ones are copied in that order. The smart pointers
+	// in and to them are attached to the copies, and the old blocks are freed without
+	// running destructors.
+	unsigned basic_ptr::compact()
+	{
+		if ( constr_stack )
+			throw ptr_exception("compacting in a constructor");
+		if ( own_guards )
+			throw ptr_exception("compacting under a trace guard");
+		lock_guard<recursive_lock> lc(cycle_m);
+		if ( exiting )
+			return 0;
+		gc(true);
+		sweep(0);
+
+		trace_exclusion te;
+		lock_guard<recursive_lock> lg(gc_m);
+		lock_guard<mutex> la(active_m);
+		lock_guard<mutex> lr(roots_m);
+		lock_guard<mutex> lh(heaps_m);
+		adopt_published();
+
+		// List the accessible blocks in depth-first order, using the mark bit
+		vector<mblock *> order, work, children, starts;
+		for_each_root([&](basic_ptr *p) { starts.push_back(p->mem); });
+		for ( auto start : starts )
+		{
+			work.push_back(start);
+			while ( !work.empty() )
+			{
+				mblock *mb = work.back();
+				work.pop_back();
+				if ( !mb || !mb->active || is_marked(mb) || mb->owner )
+					continue;
+				set_marked(mb, true);
+				order.push_back(mb);
+				if ( !mb->type->scan )
+					continue;
+
+				children.clear();
+				for ( basic_ptr *p = mb->members ; p ; p = p->next )
+					children.push_back(p->mem);
+				if ( mb->type->trace )
+				{
+					visited = &children;
+					visitor v;
+					mb->type->trace(mb->obj(), mb->nelems, v);
+					visited = nullptr;
+				}
+				work.insert(work.end(), children.rbegin(), children.rend());
+			}
+		}
+
+		// Copy the relocatable blocks, with their members lists. Slots stay in their slabs.
+		// With the mark-region heap, only the blocks of fragmented regions are evacuated, to
+		// new regions.
+		if ( regions )
+		{
+			release_area(small_area);
+			release_area(medium_area);
+			evacuating = true;
+		}
+		forwarding fw;
+		unsigned moved = 0;
+		for ( auto mb : order )
+		{
+			set_marked(mb, false);
+			if ( !mb->type->relocatable || slab_of(mb) || (regions && !fragmented(mb)) )
+				continue;
+
+			size_t size = mblock::size() + mb->objsize;
+			mblock *nb = reinterpret_cast<mblock *>(heap_alloc(size, true));
+			memcpy(static_cast<void *>(nb), mb, size);
+			basic_ptr **link = &nb->members;
+			for ( basic_ptr *p = mb->members ; p ; p = p->next )
+			{
+				basic_ptr *q = reinterpret_cast<basic_ptr *>(nb->obj() + (reinterpret_cast<char *>(p) - mb->obj()));
+				q->prev = q;
+				*link = q;
+				link = &q->next;
+			}
+			*link = nullptr;
+			if ( nb->type->finalize )
+			{
+				lock_guard<mutex> lg(final_m);
+				finalizable.erase(mb);
+				finalizable.insert(nb);
+			}
+			fw[mb] = nb;
+			moved += mb->objsize;
+		}
+		evacuating = false;
+		if ( fw.empty() )
+			return 0;
+
+		// Replace the old blocks in the active lists and attach all smart pointers to the copies
+		forwarded = &fw;
+		for_each_root([](basic_ptr *p) { p->relocate(); });
+		for ( mblock **list : { &active_blocks, &noscan_blocks } )
+			for ( mblock **mb = list ; *mb ; mb = &(*mb)->next )
+			{
+				auto i = fw.find(*mb);
+				if ( i != fw.end() )
+				{
+					i->second->next = (*mb)->next;
+					*mb = i->second;
+				}
+			}
+		auto fix = [](mblock *mb)
+		{
+			if ( !mb->type->scan )
+				return;
+			for ( basic_ptr *p = mb->members ; p ; p = p->next )
+				p->relocate();
+			if ( mb->type->trace )
+			{
+				visitor v;
+				mb->type->trace(mb->obj(), mb->nelems, v);
+			}
+		};
+		for ( mblock *mb = active_blocks ; mb ; mb = mb->next )
+			fix(mb);
+		for ( auto h : heaps )
+		{
+			lock_guard<mutex> lg(h->m);
+			for ( auto mb : h->blocks )
+				fix(mb);
+		}
+		forwarded = nullptr;
 
-namespace
-{
-	// Root smart pointers
-	mutex roots_m;						// Serialize the roots list
-	basic_ptr *roots;					// Roots list
-	
-	// Memory block globals
-	mutex active_m;						// Serialize the active blocks list
-	mblock *active_blocks;				// Active blocks
-	TLS mblock *constr_stack;			// Thread-local construction stack
-	TLS mblock *new_blocks;				// Thread-local new blocks list
+		// Free the old blocks
+		for ( auto &f : fw )
+			heap_free(f.first, mblock::size() + f.first->objsize);
+		debug(moved << " bytes moved");
+		return moved;
+	}
 
-	// Push a block at the head of a list
-	inline void push(mblock *mb, mblock *&list)
+	// Attach this to the copy of its block, if moved.
+	void basic_ptr::relocate()
 	{
-		mb->next = list;
-		list = mb;
+		auto i = forwarded->find(mem);
+		if ( i == forwarded->end() )
+			return;
+		if ( pval )
+			pval = i->second->obj() + (static_cast<char *>(pval) - mem->obj());
+		mem = i->second;
 	}
 
-	// Pop the block at the head of a list
-	inline mblock *pop(mblock *&list)
+	// Compressed references
+	unsigned basic_ptr::compress(const basic_ptr &p)
 	{
-		mblock *mb = list;
-		list = list->next;
-		return mb;
+		if ( !p.pval )
+			return 0;
+		char *obj = p.mem ? p.mem->obj() : nullptr;
+		if ( p.pval != obj || obj < heap_base || obj >= heap_end )
+			throw ptr_exception("compressed ptr value not at the start of an object array in the heap range");
+		promote(p.mem);
+		return (obj - heap_base) >> 3;
 	}
-}
 
-namespace gcptr
-{
-	/////////////////////
-	// Class basic_ptr //
-	/////////////////////
-
-	// Attachment 
-	bool basic_ptr::attach(const basic_ptr &p) { return (mem = p.mem) != nullptr; }
-	bool basic_ptr::attach() { return (mem = constr_stack) != nullptr; }
-	bool basic_ptr::is_attached() const { return mem != nullptr; }
-	void basic_ptr::detach() { mem = nullptr; }
-
-	// Garbage collector
-	unsigned basic_ptr::gc(bool unconditional)
+	void basic_ptr::expand(unsigned ref)
 	{
-		static bool busy;
+		pval = address(ref);
+		mem = ref ? reinterpret_cast<mblock *>(static_cast<char *>(pval) - mblock::size()) : nullptr;
+	}
 
-		// Exclude other threads
-		lock_guard<recursive_mutex> lg(gc_m);
+	void *basic_ptr::address(unsigned ref) { return ref ? heap_base + (size_t(ref) << 3) : nullptr; }
 
-		// Check if we should collect
-		if ( busy || (!unconditional && allocated < threshold) )
-			return 0;
+	// Snapshot barrier for compressed references, which are never roots: only the block
+	// they lose is shaded.
+	void basic_ptr::overwrite(unsigned ref)
+	{
+		if ( marking && ref )
+			shade(reinterpret_cast<mblock *>(static_cast<char *>(address(ref)) - mblock::size()));
+	}
 
-		busy = true;				// Don't re-enter in same thread
-		allocated = 0;
+	// Move the private subgraph accessible from src to a new heap.
+	local_heap *basic_ptr::pack(basic_ptr &src)
+	{
+		local_heap *h = private_heap;
+		if ( !h || !src.mem || src.mem->owner != h )	// Nothing private to move
+		{
+			*this = src;
+			src.mem = nullptr;
+			src.pval = nullptr;
+			return nullptr;
+		}
+		if ( constr_stack )
+			throw ptr_exception("packing in a constructor");
 
-		// Mark accessible blocks.
-		active_m.lock();
+		// Mark the private blocks accessible from the other roots
+		local_heap *to = new local_heap;
 		roots_m.lock();
-		mark(roots);
+		h->m.lock();
+		marking_heap = h;
+		vector<mblock *> root_blocks;
+		for_each_root([&](basic_ptr *p) { if ( p != &src ) root_blocks.push_back(p->mem); });
+		for ( auto mb : root_blocks )
+			mark(mb);
+		marking_heap = nullptr;
 		roots_m.unlock();
 
-		// Check the active blocks and separate garbage
-		mblock *active = nullptr, *garbage = nullptr;
-		while ( active_blocks )
+		// Take the subgraph, unless it contains a marked block
+		vector<mblock *> work(1, src.mem), taken;
+		bool reachable = false;
+		visited = &work;
+		while ( !work.empty() && !reachable )
 		{
-			if ( active_blocks->marked )
+			mblock *mb = work.back();
+			work.pop_back();
+			if ( !mb || mb->owner != h )
+				continue;
+			if ( is_marked(mb) )
 			{
-				active_blocks->marked = false;
-				push(pop(active_blocks), active);
+				reachable = true;
+				break;
+			}
+
+			mb->owner = to;
+			taken.push_back(mb);
+			if ( !mb->type->scan )
+				continue;
+
+			for ( basic_ptr *p = mb->members ; p ; p = p->next )
+				work.push_back(p->mem);
+			if ( mb->type->trace )
+			{
+				visitor v;
+				mb->type->trace(mb->obj(), mb->nelems, v);
 			}
-			else
-				push(pop(active_blocks), garbage);
 		}
-		active_blocks = active;
-		active_m.unlock();
+		visited = nullptr;
 
-		// Collect garbage
-		unsigned freed = 0;
-		while ( garbage )
+		for ( auto mb : h->blocks )
+			set_marked(mb, false);
+		for ( auto mb : taken )
+			if ( reachable )
+				mb->owner = h;
+			else
+			{
+				h->blocks.erase(mb);
+				to->blocks.insert(mb);
+			}
+		h->m.unlock();
+
+		if ( reachable )
 		{
-			mblock *mb = pop(garbage);
-			freed += mb->objsize;
-			mb->~mblock();
-			delete[] reinterpret_cast<char *>(mb);
+			delete to;
+			throw ptr_exception("packed objects accessible from other roots");
 		}
-		debug(freed << " bytes freed");
 
-		busy = false;
-		return freed;
+		register_heap(to);
+		mem = src.mem;
+		pval = src.pval;
+		src.mem = nullptr;
+		src.pval = nullptr;
+		return to;
 	}
 
-	// Garbage collection, mark phase.
-	void basic_ptr::mark(basic_ptr *list)
-	{ 
-		for ( ; list ; list = list->next )
+	// Move the blocks of a packed heap to this thread.
+	void basic_ptr::unpack(local_heap *h)
+	{
+		if ( !h )
+			return;
+
+		local_heap *to = private_heap;
+		if ( !to )
+			release(h);
+		else
 		{
-			mblock *mb = list->mem;
-			if ( mb && mb->active && !mb->marked )
+			lock_guard<mutex> lg1(to->m);
+			lock_guard<mutex> lg2(h->m);
+			for ( auto mb : h->blocks )
 			{
-				mb->marked = true;
-				mark(mb->members);
+				mb->owner = to;
+				to->allocated += mb->objsize;
 			}
+			to->blocks.insert(h->blocks.begin(), h->blocks.end());
+			h->blocks.clear();
 		}
+		unregister_heap(h);
+		delete h;
 	}
 
 	// Constructors, assignment operators and destructor.
 	basic_ptr::basic_ptr() : mem(nullptr), pval(nullptr) { link(); }
-	basic_ptr::basic_ptr(const basic_ptr &src) : mem(src.mem), pval(src.pval) { link(); }
+	basic_ptr::basic_ptr(const basic_ptr &src) : mem(src.mem), pval(src.pval) { link(); shade(mem); }
+
+	// Snapshot barrier. While the collector is marking, the block a smart pointer loses is
+	// shaded, so that the blocks accessible when marking began are all marked, and the block
+	// it gains is shaded too, since roots are only scanned once.
 	basic_ptr &basic_ptr::operator =(const basic_ptr &src)
 	{
+		if ( marking )
+		{
+			shade(mem);
+			shade(src.mem);
+		}
 		mem = src.mem;
 		pval = src.pval;
+		escape();
 		return *this;
 	}
 	basic_ptr::basic_ptr(void *src) : mem(nullptr), pval(src) { link(); }
@@ -187,9 +2343,34 @@ namespace gcptr
 		pval = src;
 		return *this;
 	}
-	basic_ptr::basic_ptr(const basic_ptr &src, void *p) : mem(src.mem), pval(p) { link(); }
-	basic_ptr::~basic_ptr() { unlink(); }
+	basic_ptr::basic_ptr(const basic_ptr &src, void *p) : mem(src.mem), pval(p) { link(); shade(mem); }
+
+	// A smart pointer that is not a root loses its block when destroyed, unless by the sweep,
+	// which only destroys garbage: the block is shaded, as by an assignment.
+	basic_ptr::~basic_ptr()
+	{
+		if ( prev == this && !sweeping )
+			shade(mem);
+		unlink();
+	}
+
+	// Smart pointers that are neither roots nor members are marked as members, see unlink().
+	// A copy goes through the write and snapshot barriers, as an assignment does: a traced_ptr
+	// copied into an object already traced during a collection would otherwise be missed.
+	basic_ptr::basic_ptr(unlinked_t) : next(nullptr), prev(this), mem(nullptr), pval(nullptr) { }
+	basic_ptr::basic_ptr(const basic_ptr &src, unlinked_t) : next(nullptr), prev(this), 
+		mem(src.mem), pval(src.pval) { shade(mem); escape(); }
 	
+	// Traced smart pointers change under a trace guard, or while their holder is constructed
+	// or destroyed
+	void basic_ptr::guarded()
+	{
+#if GC_DEBUG
+		if ( !own_guards && !excluding && !sweeping && !constr_stack )
+			throw ptr_exception("traced ptr changed without a trace guard");
+#endif
+	}
+
 	// Check that this can be dereferenced.
 	void basic_ptr::check() const
 	{
@@ -199,17 +2380,149 @@ namespace gcptr
 			throw ptr_exception("dereferencing out of bounds ptr"); 
 	}
 
-	// Begin allocation
-	void *basic_ptr::alloc_begin(unsigned nelems, unsigned elem_size, destructor destr, bool zero)
+	// Atomic access to the attachment. The block pointer is accessed with full barriers, so
+	// that an operation either precedes the mark phase or sees the marking flag set.
+	static void check_atomic(mblock *mb, void *pval)
+	{
+		if ( pval != (mb ? mb->obj() : nullptr) )
+			throw ptr_exception("atomic ptr value not at the start of an object array");
+	}
+
+	void basic_ptr::atomic_load(basic_ptr &dst) const
+	{
+		atomic_op op;
+		mblock *mb = *static_cast<mblock * const volatile *>(&mem);
+		__sync_synchronize();
+		shade(mb);
+		dst.mem = mb;
+		dst.pval = mb ? mb->obj() : nullptr;
+	}
+
+	void basic_ptr::atomic_store(const basic_ptr &src)
+	{
+		basic_ptr old(src, unlinked_t());
+		atomic_exchange(old);
+	}
+
+	void basic_ptr::atomic_exchange(basic_ptr &val)
+	{
+		check_atomic(val.mem, val.pval);
+		promote(val.mem);
+		atomic_op op;
+		mblock *old;
+		do
+			old = mem;
+		while ( !__sync_bool_compare_and_swap(&mem, old, val.mem) );
+		shade(old);
+		val.mem = old;
+		val.pval = old ? old->obj() : nullptr;
+	}
+
+	bool basic_ptr::atomic_compare_exchange(basic_ptr &expected, const basic_ptr &desired)
+	{
+		check_atomic(desired.mem, desired.pval);
+		promote(desired.mem);
+		atomic_op op;
+		mblock *old = __sync_val_compare_and_swap(&mem, expected.mem, desired.mem);
+		shade(old);
+		if ( old == expected.mem )
+			return true;
+		expected.mem = old;
+		expected.pval = old ? old->obj() : nullptr;
+		return false;
+	}
+
+	// Allocate a coroutine frame and enter it, so that parameter copies are members.
+	void *basic_ptr::frame_alloc(unsigned size, void (*destroy)(void *frame))
+	{
+		basic_ptr p;
+		p.alloc_begin(1, frame_prefix::size() + size, frame_prefix::type, false);
+		frame_prefix *fr = new(p.pval) frame_prefix(p.mem, destroy);
+		p.mem->owner = nullptr;				// Frames may be resumed by any thread
+		p.mem->members = &fr->members;
+		p.alloc_end(1);
+		frame_enter(fr->addr());
+		return fr->addr();
+	}
+
+	// The owner destroyed the frame. The block is released when no longer accessible.
+	void basic_ptr::frame_free(void *addr)
+	{
+		frame_prefix *fr = frame_prefix::at(addr);
+		frame_leave(addr);
+		fr->self.mem->nelems = 0;
+	}
+
+	// Make a frame the running one in this thread. It is a root until left.
+	void basic_ptr::frame_enter(void *addr)
+	{
+		frame_prefix *fr = frame_prefix::at(addr);
+		if ( running_frame == fr->self.mem )
+			return;
+		fr->self.link();
+		fr->saved = running_frame;
+		running_frame = fr->self.mem;
+	}
+
+	// Return to the frame that was running before.
+	void basic_ptr::frame_leave(void *addr)
+	{
+		frame_prefix *fr = frame_prefix::at(addr);
+		if ( running_frame != fr->self.mem )
+			return;
+		running_frame = fr->saved;
+		fr->self.unlink();
+	}
+
+	// Attach to a coroutine frame and point to it.
+	bool basic_ptr::frame_attach(void *addr)
 	{
-		// Eventually collect garbage
-		gc(false);
+		mem = frame_prefix::at(addr)->self.mem;
+		pval = addr;
+		return true;
+	}
+
+	// Eventually collect garbage, unless collections are deferred and the pending collection
+	// has not let allocated memory grow to twice the threshold. In real-time mode, the
+	// collector thread does it all.
+	void basic_ptr::alloc_collect(unsigned objsize)
+	{
+		if ( realtime )
+			return;
+		if ( !deferred || overdue )
+			gc(false);
 
-		// Allocate memory block (header + objects)
+		// Collect the private blocks of this thread, out of constructors
+		if ( private_heap && private_heap->allocated >= threshold && !constr_stack )
+			gc_private();
+
+		// Assist: sweep garbage in proportion to the allocation
+		if ( unswept_bytes && !sweeping )
+			sweep(assist_ratio * objsize);
+	}
+
+	// Begin allocation
+	void *basic_ptr::alloc_begin(unsigned nelems, unsigned elem_size, const objtype &type, bool zero, const basic_ptr *near)
+	{
 		unsigned objsize = nelems * elem_size;
+		alloc_collect(objsize);
+
+		// Allocate memory block (header + objects). Single objects of slab-cached types take a
+		// slot of their cache. Nested blocks are placed near the block in construction, and
+		// blocks of types whose constructors allocate are placed in the window of this thread,
+		// which their nested blocks then follow.
+		const void *hint = near ? near->mem : constr_stack;
+		if ( constr_stack && !__atomic_load_n(&constr_stack->type->nests, __ATOMIC_RELAXED) )
+			__atomic_store_n(&constr_stack->type->nests, true, __ATOMIC_RELAXED);
+		char *raw;
 		try
 		{
-			mem = reinterpret_cast<mblock *>(new char[mblock::size() + objsize]);
+			if ( type.cached && nelems == 1 )
+				raw = slab_alloc(slabs_of(type, objsize));
+			else if ( hint || __atomic_load_n(&type.nests, __ATOMIC_RELAXED) )
+				raw = heap_alloc_near(mblock::size() + objsize, hint);
+			else
+				raw = heap_alloc(mblock::size() + objsize);
 		}
 		catch (...)
 		{
@@ -217,16 +2530,41 @@ namespace gcptr
 			throw;
 		}
 
-		// Initialize header and memory and push block on the construction stack
-		new(mem) mblock(nelems, objsize, destr);
-		char *obj = mem->obj();
+		// Initialize header and memory and push block on the construction stack. This may
+		// be a root, so its block must be initialized before a concurrent collection sees it.
+		mblock *mb = new(raw) mblock(nelems, objsize, type);
+		mb->owner = private_heap;
+		char *obj = mb->obj();
 		if ( zero )
 			fill(obj, obj + objsize, 0);
-		push(mem, constr_stack);
+		push(mb, constr_stack);
+		atomic_thread_fence(memory_order_release);
+		shade(mem);
+		mem = mb;
 
 		return pval = obj;
 	}
 
+	// Reuse a pooled block, as alloc_begin() and alloc_end() would do with a new one. The
+	// block is out of the pool and of the heap while collecting, so that no sweep sees it.
+	bool basic_ptr::alloc_reuse(const objtype &type)
+	{
+		if ( !__atomic_load_n(&type.pool, __ATOMIC_RELAXED) )
+			return false;
+		mblock *mb = pool_of(type)->take();
+		if ( !mb )
+			return false;
+		alloc_collect(mb->objsize);
+		mb->owner = private_heap;
+		push(mb, constr_stack);
+		atomic_thread_fence(memory_order_release);
+		shade(mem);
+		mem = mb;
+		pval = mb->obj();
+		alloc_end(1);
+		return true;
+	}
+
 	// End allocation. 
 	void basic_ptr::alloc_end(unsigned nconstructed)
 	{ 
@@ -239,69 +2577,260 @@ namespace gcptr
 		{
 			mem->nelems = nconstructed;
 			mem->~mblock();
-			delete[] reinterpret_cast<char *>(mem);
+			free_block(mem);
 			mem = nullptr;
 		}
 		else
 		{
-			gc_m.lock();
-			allocated += mem->objsize;
-			gc_m.unlock();
+			if ( mem->owner )
+				mem->owner->allocated += mem->objsize;
+			else
+			{
+				gc_m.lock();
+				allocated += mem->objsize;
+				bool wake = allocated >= threshold && !pending;
+				if ( allocated >= threshold )
+					pending = true;
+				if ( allocated >= 2 * threshold )
+					overdue = true;
+				gc_m.unlock();
+				if ( wake && realtime )
+					collector.cv->notify_one();
+			}
+			if ( mem->type->finalize )
+			{
+				lock_guard<mutex> lg(final_m);
+				finalizable.insert(mem);
+			}
 			push(mem, new_blocks);
 		}
 
 		if ( constr_stack )					// Finished nested block
 			return;
 		
-		// Finished bottom block, activate all new blocks
-		active_m.lock();
-		while ( new_blocks )
+		// Finished bottom block, activate all new blocks: private ones in the heap of this
+		// thread, and shared ones by publishing them with a single compare-and-swap, without
+		// global locks
+		if ( private_heap )
 		{
-			new_blocks->active = true;
-			push(pop(new_blocks), active_blocks);
+			mblock *shared = nullptr;
+			private_heap->m.lock();
+			while ( new_blocks )
+			{
+				mblock *mb = pop(new_blocks);
+				mb->active = true;
+				if ( mb->owner )
+					private_heap->blocks.insert(mb);
+				else
+					push(mb, shared);
+			}
+			private_heap->m.unlock();
+			if ( !(new_blocks = shared) )
+				return;
 		}
-		active_m.unlock();
+		if ( !new_blocks )
+			return;
+		mblock *last = new_blocks;
+		for ( last->active = true ; last->next ; last = last->next )
+			last->next->active = true;
+		mblock *head = published.load(memory_order_relaxed);
+		do
+			last->next = head;
+		while ( !published.compare_exchange_weak(head, new_blocks, memory_order_release, memory_order_relaxed) );
+		new_blocks = nullptr;
 	}
 
-	// Insert this in the roots or members list
+	// Register this as a root or insert it in a members list
 	inline void basic_ptr::link()
 	{
 		if ( constr_stack && constr_stack->contains(this) )	// A member
 		{
 //			debug("member " << this);
+#if GC_DEBUG
+			if ( !constr_stack->type->scan )
+				throw ptr_exception("smart pointer member in a no-scan object");
+#endif
 			next = constr_stack->members;
 			constr_stack->members = prev = this;			// See unlink()
+			if ( mem && mem->owner != constr_stack->owner )
+				promote(mem);
+		}
+		else if ( running_frame && running_frame->contains(this) )	// A member of a coroutine frame
+		{
+			basic_ptr *head = &frame_prefix::of(running_frame)->members;
+			roots_m.lock();
+			prev = head;
+			if ( (next = head->next) )
+				next->prev = this;
+			head->next = this;
+			roots_m.unlock();
+			promote(mem);
+		}
+		else if ( shadow && shadow->top.load(memory_order_relaxed) < shadow->limit &&
+			reinterpret_cast<char *>(this) >= shadow->lo && reinterpret_cast<char *>(this) < shadow->hi )
+		{													// A root in a root scope
+			unsigned i = shadow->top.load(memory_order_relaxed);
+			prev = scoped;
+			next = reinterpret_cast<basic_ptr *>(&shadow->slots[i]);
+			shadow->slots[i].store(this, memory_order_release);
+			shadow->top.store(i + 1, memory_order_release);
 		}
 		else												// A root
 		{
 //			debug("root " << this);
 			prev = nullptr;
-			roots_m.lock();
-			if ( (next = roots) )
-				roots->prev = this;
-			roots = this;
-			roots_m.unlock();
+			next = reinterpret_cast<basic_ptr *>(add_root(this));
 		}
 	}
 
-	// If this is a root, remove it from the roots list
+	// If this is a root or a member of a coroutine frame, release its slot or remove it from
+	// the members list
 	inline void basic_ptr::unlink()
 	{
 		if ( prev == this )		// A member, see link()
 			return;
+		if ( prev == scoped )	// A root in a root scope
+		{
+			release_slot(reinterpret_cast<atomic<basic_ptr *> *>(next));
+			return;
+		}
+		if ( !prev )			// A root
+		{
+//			debug("root " << this);
+			remove_root(reinterpret_cast<basic_ptr **>(next));
+			return;
+		}
 
-//		debug("root " << this);
 		roots_m.lock();
 		if ( next )
 			next->prev = prev;
-		if ( prev )
-			prev->next = next;
-		else
-			roots = next;
+		prev->next = next;
 		roots_m.unlock();
 	}
 
 
+	//////////////////////
+	// Class root_scope //
+	//////////////////////
+
+	// Begin a scope, with the shadow stack of this thread created on first use
+	root_scope::root_scope(unsigned nslots)
+	{
+		shadow_stack *s = shadow;
+		if ( !s )
+		{
+			stack_range r;
+			if ( !stack_bounds(r) )
+				throw ptr_exception("thread stack unknown");
+			s = new shadow_stack();
+			s->lo = r.lo;
+			s->hi = r.hi;
+			lock_guard<mutex> lg(roots_m);
+			shadow_stacks.push_back(s);
+			shadow = s;
+			register_thread();
+		}
+
+		base = s->base;
+		limit = s->limit;
+		s->base = s->top.load(memory_order_relaxed);
+		s->limit = min(s->base + nslots, max_slots);
+	}
+
+	// End the scope. The roots left in its slots are registered before their slot is
+	// released, see for_each_root().
+	root_scope::~root_scope()
+	{
+		shadow_stack *s = shadow;
+		unsigned top = s->top.load(memory_order_relaxed);
+		for ( unsigned i = s->base ; i < top ; i++ )
+		{
+			basic_ptr *p = s->slots[i].load(memory_order_relaxed);
+			if ( !p )
+				continue;
+			p->prev = nullptr;
+			p->next = reinterpret_cast<basic_ptr *>(add_root(p));
+			s->slots[i].store(nullptr, memory_order_release);
+		}
+
+		top = s->base;
+		s->base = base;
+		s->limit = limit;
+		while ( top > base && !s->slots[top - 1].load(memory_order_relaxed) )
+			top--;
+		s->top.store(top, memory_order_release);
+	}
+
+
+	///////////////////////
+	// Class trace_guard //
+	///////////////////////
+
+	// Nested guards and guards taken by an excluding thread, e.g. in destructors run by the
+	// collector, don't wait.
+	trace_guard::trace_guard()
+	{
+		if ( own_guards++ || excluding )
+		{
+			guards++;
+			return;
+		}
+		for ( ;; )
+		{
+			guards++;
+			if ( !tracing )
+				return;
+			guards--;
+			while ( tracing )
+				this_thread::yield();
+		}
+	}
+
+	trace_guard::~trace_guard()
+	{
+		own_guards--;
+		guards--;
+	}
+
+
+	///////////////////
+	// Class visitor //
+	///////////////////
+
+	// Traced smart pointers are marked like members
+	void visitor::operator ()(const basic_ptr &p)
+	{
+		if ( clearing )
+		{
+			const_cast<basic_ptr &>(p).mem = nullptr;
+			const_cast<basic_ptr &>(p).pval = nullptr;
+		}
+		else if ( forwarded )
+			const_cast<basic_ptr &>(p).relocate();
+		else if ( visited )
+			visited->push_back(p.mem);
+		else
+			basic_ptr::mark(p.mem);
+	}
+
+	// Compressed references likewise
+	void visitor::visit(unsigned &ref)
+	{
+		mblock *mb = ref ? reinterpret_cast<mblock *>(static_cast<char *>(basic_ptr::address(ref)) - mblock::size()) : nullptr;
+		if ( clearing )
+			ref = 0;
+		else if ( forwarded )
+		{
+			auto i = forwarded->find(mb);
+			if ( i != forwarded->end() )
+				ref = (i->second->obj() - heap_base) >> 3;
+		}
+		else if ( visited )
+			visited->push_back(mb);
+		else
+			basic_ptr::mark(mb);
+	}
+
 	/////////////////////////
 	// Class ptr_exception //
 	/////////////////////////
@@ -315,6 +2844,120 @@ namespace gcptr
 
 	unsigned collect() { return basic_ptr::gc(true); }
 
+	void defer_collections(bool defer) { deferred = defer; }
+
+	bool collection_pending() { return pending; }
+
+	void thread_private(bool enable)
+	{
+		local_heap *h = private_heap;
+		if ( enable == (h != nullptr) )
+			return;
+
+		if ( enable )
+		{
+			register_heap(private_heap = new local_heap);
+			register_thread();
+			return;
+		}
+
+		// Share all private blocks
+		release(h);
+		unregister_heap(h);
+		private_heap = nullptr;
+		delete h;
+	}
+
+	unsigned collect_private() { return basic_ptr::gc_private(); }
+
+	unsigned compact() { return basic_ptr::compact(); }
+
+	bool heap_reserve(size_t size)
+	{
+		lock_guard<mutex> lg(heap_m);
+		if ( heap_base || size > size_t(1) << 35 )		// 2^32 offsets scaled by 8
+			return false;
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if ( p == MAP_FAILED )
+			return false;
+		heap_top = heap_base = static_cast<char *>(p);
+		heap_end = heap_base + size;
+		return true;
+	}
+
+	bool heap_regions()
+	{
+		lock_guard<mutex> lg(heap_m);
+		if ( heap_used )
+			return false;
+		regions = true;
+		return true;
+	}
+
+	bool heap_fork_friendly()
+	{
+		lock_guard<mutex> lg(heap_m);
+		if ( mark_bits )
+			return true;
+		if ( !heap_base || heap_used )
+			return false;
+		size_t size = (heap_end - heap_base) / 16 / 8;
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if ( p == MAP_FAILED )
+			return false;
+		mark_bits = static_cast<atomic<unsigned long long> *>(p);
+		return true;
+	}
+
+	sweep_mode collect_sweep_mode() { return smode; }
+
+	void collect_sweep_mode(sweep_mode mode)
+	{
+		gc_m.lock();
+		smode = mode;
+		gc_m.unlock();
+	}
+
+	unsigned collect_assist(unsigned newratio)
+	{
+		gc_m.lock();
+		unsigned oldratio = assist_ratio;
+		if ( newratio )
+			assist_ratio = newratio;
+		gc_m.unlock();
+		return oldratio;
+	}
+
+	unsigned collect_sweep(unsigned bytes) { return unswept_bytes ? sweep(bytes) : 0; }
+
+	bool collect_realtime() { return realtime; }
+
+	void collect_realtime(bool enable)
+	{
+		if ( enable )
+		{
+			lock_guard<recursive_lock> lg(gc_m);
+			realtime = true;
+			collector.start();
+		}
+		else										// The collector locks gc_m
+		{
+			collector.stop();
+			realtime = false;
+		}
+	}
+
+	bool fast_exit() { return fast; }
+
+	void fast_exit(bool enable)
+	{
+		static bool registered;
+		lock_guard<recursive_lock> lg(gc_m);
+		if ( enable && !registered )
+			registered = !atexit(exit_fast);
+		fast = enable;
+	}
+
 	unsigned collect_threshold(unsigned newthr)
 	{
 		gc_m.lock();
@@ -12,13 +12,41 @@ constexpr bool use_default_constructor() { return !std::has_trivial_default_cons
 
 namespace gcptr
 {
-	// Array destructors
-	typedef void (*destructor)(void *obj, unsigned nelems);
-
 	// Forward declarations
 	struct mblock;
+	struct frame_prefix;
+	struct local_heap;
+	struct slab_cache;
+	struct recycle_pool;
 	class basic_ptr;
+	class visitor;
+	class root_scope;
 	template <typename T> class ptr;
+	template <typename T> class compressed_ptr;
+
+	// Array destructors
+	typedef void (*destructor)(void *obj, unsigned nelems);
+
+	// Array tracers
+	typedef void (*tracer)(void *obj, unsigned nelems, visitor &v);
+
+	// Object resetters
+	typedef void (*resetter)(void *obj);
+
+	// Object type descriptor, one per type of managed object.
+	struct objtype
+	{
+		destructor destroy;			// Array destructor, null for trivial destructors
+		tracer trace;				// Array tracer, null for types without a trace() method
+		bool scan;					// Objects may contain smart pointers
+		bool relocatable;			// Objects may be moved by compact()
+		mutable bool nests;			// Constructors were seen allocating (atomic), see alloc_near()
+		bool cached;				// Single objects are allocated in slabs, see slab_cached
+		bool finalize;				// Objects are destroyed at fast exit, see needs_finalization
+		resetter reset;				// Object resetter, null unless the type is recycled
+		mutable slab_cache *slabs;	// Slab cache, created by the first such allocation (atomic)
+		mutable recycle_pool *pool;	// Recycle pool, created by the first such sweep (atomic)
+	};
 
 	// Garbage collection. Returns amount of freed memory.
 	unsigned collect();
@@ -26,6 +54,170 @@ namespace gcptr
 	// Get/set the threshold of memory allocated since last collection necessary to force a new one.
 	unsigned collect_threshold(unsigned newthr = 0);
 
+	// Defer the collections triggered by allocations in this thread, or stop deferring them.
+	// Deferred collections stay pending until some thread calls collect(), e.g. at a safepoint.
+	// Deferring is bounded: once allocated memory reaches twice the threshold, the next
+	// allocation of a deferring thread collects anyway, so that memory can't grow unchecked.
+	void defer_collections(bool defer);
+
+	// Tells whether the threshold has been reached and a collection is pending.
+	bool collection_pending();
+
+	// Sweep modes. Eager: a collection destroys and frees its garbage before returning.
+	// Lazy: a collection only separates its garbage, which is then destroyed and freed by
+	// allocating threads in proportion to their allocations (mutator assist), and finally
+	// by the next collection. Background: as lazy, and a background thread also sweeps, so that
+	// collections only pause allocating threads for marking. collect() returns the amount of
+	// garbage found in lazy and background modes.
+	enum sweep_mode { sweep_eager, sweep_lazy, sweep_background };
+
+	// Get/set the sweep mode. Default is eager.
+	sweep_mode collect_sweep_mode();
+	void collect_sweep_mode(sweep_mode mode);
+
+	// Get/set the assist ratio: bytes of pending garbage an allocating thread must sweep
+	// per byte it allocates. Default is 2.
+	unsigned collect_assist(unsigned newratio = 0);
+
+	// Sweep at least the given amount of the garbage left by lazy and background collections,
+	// or all of it if 0, in this thread. Idle threads call it to take sweeping off allocating
+	// threads. Returns amount of freed memory.
+	unsigned collect_sweep(unsigned bytes = 0);
+
+	// Real-time mode. Collections run on a collector thread, which marks while the other
+	// threads keep running and then sweeps, whatever the sweep mode. When the threshold is
+	// reached, allocations wake it up instead of collecting, and never sweep nor collect
+	// private blocks (call collect_private()). The cost of operations is then bounded:
+	// - An allocation costs the memory allocation, with the reserved range or the mark-region
+	//   heap a free list or bump allocation, plus one lock of two global mutexes whose holders
+	//   only update counters or link lists in constant time.
+	// - Storing a smart pointer costs one flag test, plus two locks of a mutex held for a
+	//   vector append while the collector is marking.
+	// - Constructing and destroying a root costs a lock of the mutex of its root chunk, held
+	//   by the collector to copy the chunk's roots, up to 400 pointer copies, once per
+	//   collection. When the chunk of the thread is full, a new root also locks the chunk
+	//   registry, which the collector holds while it copies the roots of all the chunks: that
+	//   wait grows with the number of roots. Inside a root_scope, constructing a root takes no
+	//   lock, and destroying one waits for a scan of the shadow stack of the thread in progress.
+	// thread_private(false), share(), collect(), collect_private() and compact() are not
+	// bounded, nor is the collector if allocation outpaces it: memory grows meanwhile.
+	// The bounds above assume no thread_private() and no needs_finalization types. While any
+	// thread allocates privately, storing a smart pointer outside a root runs the write barrier:
+	// a lookup in the set of private blocks of the storing thread under its mutex, and, when a
+	// private object escapes, a walk of the whole private subgraph it reaches. Private
+	// allocations insert their blocks into that set, and allocations of needs_finalization
+	// types insert theirs into the set of finalizable blocks under a global mutex. Set
+	// operations are logarithmic in the number of blocks; escapes are unbounded.
+	// Default is off.
+	bool collect_realtime();
+	void collect_realtime(bool enable);
+
+	// Fast exit. At process exit, the heap is neither collected nor swept: the objects of the
+	// types flagged by needs_finalization are destroyed, accessible or not and in no particular
+	// order, and the other objects are left for the system to reclaim with the process memory.
+	// Collections requested afterwards, e.g. by destructors of static objects, do nothing.
+	// Other threads must not use garbage-collected objects while the process exits.
+	// Default is off.
+	bool fast_exit();
+	void fast_exit(bool enable);
+
+	// Reserve a contiguous range of virtual memory of at most 32 GB for the heap, before any
+	// allocation. Blocks are then allocated in the range, where compressed_ptr can refer to them
+	// and alloc_near() can place them, and allocations beyond its end throw std::bad_alloc.
+	// Returns false if not reserved.
+	bool heap_reserve(std::size_t size);
+
+	// Use the mark-region heap engine, before any allocation. Blocks of at most 8 KB are then
+	// bump-allocated in the free lines of 32 KB regions, within the reserved range if any, and
+	// lines are reused once the blocks overlapping them have been swept. Returns false if
+	// blocks were already allocated.
+	bool heap_regions();
+
+	// Fork-friendly heap, for processes that fork workers after building their object graph.
+	// Mark bits are kept in a bitmap beside the reserved range instead of the block headers, so
+	// that collections in a worker only write to the headers of garbage blocks and of their
+	// neighbours in the active lists, and the pages of the graph stay shared with the parent.
+	// Call after heap_reserve(), before any allocation. Returns false if no range is reserved or
+	// blocks were already allocated.
+	// Whatever the heap, fork() may be called at any time: the collector's mutexes are held
+	// across it, and the child gives up the private heaps and the roots on the stacks of the
+	// other threads: objects only they refer to are garbage in the child. The background
+	// sweeper and real-time collector threads are not copied; the child starts its own when
+	// needed.
+	bool heap_fork_friendly();
+
+	// Compaction: move the relocatable objects accessible from the roots to new memory in
+	// depth-first order of their references, so that linked objects end up adjacent. Garbage is
+	// collected first. No other thread may use garbage-collected objects meanwhile, and no raw
+	// pointer to a relocatable object may be held across the call. With the mark-region heap,
+	// only the objects of regions where sweeping freed at least half the lines are moved.
+	// Returns amount of moved memory.
+	unsigned compact();
+
+	// Thread-private allocation. While enabled, the blocks allocated by this thread are private
+	// to it: global collections leave them alone, and the thread collects them by itself without
+	// stopping the others. A private block becomes shared, with the private blocks it refers to,
+	// when a smart pointer to it is stored into a shared object, a coroutine frame or an
+	// atomic_ptr, or by basic_ptr::share(). Private objects must not reach other threads by any
+	// other means. Disabling shares all the private blocks of the thread, as its exit does.
+	// The storage of a traced_ptr, e.g. a vector element, can't be told from memory of other
+	// threads, so storing a private object into a traced_ptr, by construction or assignment,
+	// makes it shared, even when the vector belongs to a private object.
+	void thread_private(bool enable);
+
+	// Collect the private blocks of this thread. Also done by allocations when the memory
+	// allocated privately since the last one reaches the threshold. Objects in construction
+	// keep alive the private objects their member smart pointers refer to, but their traced
+	// pointers are not scanned until their constructor returns. Returns amount of freed memory.
+	unsigned collect_private();
+
+	// Pointer-free types. Their arrays are kept in a separate no-scan space, where the collector
+	// only sets a mark bit and never looks for member smart pointers. Scalars and arrays of
+	// scalars are pointer-free; specialize as true_type for user types without ptr members.
+	// Members and traced pointers of a no-scan type are never scanned and keep nothing alive:
+	// with GC_DEBUG, constructing a member smart pointer in one throws ptr_exception.
+	template <typename T> struct no_scan
+		: std::is_scalar<typename std::remove_all_extents<T>::type> { };
+
+	// Relocatable types, whose objects compact() may move with memcpy. The collector updates the
+	// smart pointers in them and to them, but nothing else may depend on their address (as e.g.
+	// std::string does). Scalars are relocatable; specialize as true_type for other types, such
+	// as nodes of linked structures made of scalars and smart pointers.
+	template <typename T> struct relocatable
+		: std::is_scalar<typename std::remove_all_extents<T>::type> { };
+
+	// Slab-cached types. Single objects of these types are allocated in slabs of slots of their
+	// exact size, which are only ever reused for objects of the same type: swept objects give
+	// their slot back to the cache of the type, and slab memory is never freed. Arrays use the
+	// general heap. Specialize as true_type for types allocated at high rates.
+	template <typename T> struct slab_cached : std::false_type { };
+
+	// Types whose objects must be destroyed even at fast exit, e.g. to flush buffers or release
+	// resources outside the process. Specialize as true_type.
+	template <typename T> struct needs_finalization : std::false_type { };
+
+	// Recycled types, for objects that are expensive to construct and destroy. Instead of being
+	// destroyed, swept single objects of these types have their member and traced smart pointers
+	// and compressed references cleared, are reset by their reset() method and kept in a pool of
+	// their type, up to 1024 objects; alloc() without arguments then takes a pooled object,
+	// without running any constructor, and counts towards the collection threshold. reset()
+	// must restore the state of a newly constructed object and, like destructors, must not
+	// dereference smart pointers. Specialize as true_type.
+	template <typename T> struct recycled : std::false_type { };
+
+	// Does T have a trace(visitor &) method?
+	template <typename T> class has_trace
+	{
+		template <typename U>
+		static char test(decltype(std::declval<U &>().trace(std::declval<visitor &>())) *);
+		template <typename U>
+		static long test(...);
+
+		public:
+
+			static const bool value = sizeof(test<T>(nullptr)) == 1;
+	};
+
 	// Untyped basic smart pointer
 	class basic_ptr
 	{
@@ -39,6 +231,30 @@ namespace gcptr
 
 			// Used by the garbage collector
 			static void mark(basic_ptr *list);
+			static void mark(mblock *mb);
+			static void scan(mblock *mb);
+
+			// Thread-private blocks
+			void escape();
+			static void promote(mblock *mb);
+
+			// Compaction
+			void relocate();
+			friend class visitor;
+			friend class root_scope;
+			friend struct frame_prefix;
+			friend struct recycle_pool;
+			template <typename T> friend class compressed_ptr;
+
+			// Compressed references, used by compressed_ptr. An object array in the reserved
+			// heap range is referred to by its offset in the range divided by 8, 0 for null.
+			static unsigned compress(const basic_ptr &p);
+			void expand(unsigned ref);
+			static void *address(unsigned ref);
+			static void overwrite(unsigned ref);
+
+			// Real-time collection
+			static unsigned gc_incremental(bool unconditional);
 
 		public:
 
@@ -54,9 +270,27 @@ namespace gcptr
 			// Detach.
 			void detach();
 
+			// Make the attached object array shared, if private to this thread (see thread_private()).
+			void share() const;
+
+			// Destroy and free the attached object array at once, instead of at the next
+			// collection, and detach. No other smart pointer may refer to it: debug builds check
+			// that it is not accessible from the roots, and throw ptr_exception if it is. Only
+			// private arrays and shared ones allocated since the last collection are freed: the
+			// array is left to the collector if it is older, if it is still in construction, if
+			// dispose() is called by a destructor run by the collector, or in real-time mode
+			// while a collection runs. Returns true if freed.
+			bool dispose();
+
 			// Collect garbage if necessary, or unconditionally. Returns amount of freed memory.
 			static unsigned gc(bool unconditional);
 
+			// Collect the private blocks of this thread. Returns amount of freed memory.
+			static unsigned gc_private();
+
+			// Collect garbage and move relocatable blocks. Returns amount of moved memory.
+			static unsigned compact();
+
 		protected:
 
 			// Constructors, assignment operators and destructor.
@@ -68,15 +302,57 @@ namespace gcptr
 			basic_ptr(const basic_ptr &src, void *p);
 			~basic_ptr();
 
+			// Constructors of smart pointers that are neither roots nor members. The collector
+			// only finds them through the trace() method of the object that holds them.
+			struct unlinked_t { };
+			basic_ptr(unlinked_t);
+			basic_ptr(const basic_ptr &src, unlinked_t);
+
+			// Debug check that this thread may change traced smart pointers, see visitor.
+			static void guarded();
+
 			// Check that this can be dereferenced:
 			// (1) Pointer value is not null.
 			// (2) If attached, it points into the attached object array.
 			void check() const;
 
 			// Allocation of garbage-collected object arrays.
-			void *alloc_begin(unsigned nelems, unsigned elem_size, destructor destr, bool zero);
+			// Blocks are placed near the block of near, if given, or the block in construction
+			// (see heap_reserve()).
+			void *alloc_begin(unsigned nelems, unsigned elem_size, const objtype &type, bool zero,
+				const basic_ptr *near = nullptr);
 			void alloc_end(unsigned nconstructed);
 
+			// Collect, or assist the sweep, as due before allocating objsize bytes.
+			static void alloc_collect(unsigned objsize);
+
+			// Take a pooled object of a recycled type instead of allocating and constructing
+			// one. Returns false if the pool is empty.
+			bool alloc_reuse(const objtype &type);
+
+			// Atomic access to the attachment of this, used by atomic_ptr. Only the block pointer
+			// is stored, so values must be null or point to the first element of their array.
+			void atomic_load(basic_ptr &dst) const;
+			void atomic_store(const basic_ptr &src);
+			void atomic_exchange(basic_ptr &val);
+			bool atomic_compare_exchange(basic_ptr &expected, const basic_ptr &desired);
+
+			// Coroutine frames, used by gccoro.h. A frame is allocated as a block whose members
+			// are the smart pointers created in the frame while the coroutine runs (entered).
+			// They are unlinked when destroyed, so they may come and go during the coroutine.
+			static void *frame_alloc(unsigned size, void (*destroy)(void *frame));
+			static void frame_free(void *frame);
+			static void frame_enter(void *frame);
+			static void frame_leave(void *frame);
+			bool frame_attach(void *frame);
+
+			// Transfer of thread-private objects, used by parcel. pack() moves the private blocks
+			// accessible from src to a new heap, throwing ptr_exception if the other roots of this
+			// thread can reach any of them, and moves src to this. unpack() moves the blocks of
+			// such a heap to the heap of this thread, or makes them shared if it has none.
+			local_heap *pack(basic_ptr &src);
+			static void unpack(local_heap *h);
+
 			// Pointer to memory block, null if not attached.
 			mblock *mem;
 
@@ -84,6 +360,74 @@ namespace gcptr
 			void *pval;
 	};
 
+	// Visitor passed to trace() methods. Objects that keep smart pointers in storage not
+	// managed by the collector (e.g. a std::vector<traced_ptr<T>> member) implement
+	//
+	//	void trace(visitor &v) { for ( auto &p : vec ) v(p); }
+	//
+	// and the collector treats every visited smart pointer as a member of the object.
+	//
+	// trace() runs on collecting threads while the thread that owns the object keeps running.
+	// Storage visited by trace() must therefore only change while the thread changing it holds
+	// a trace_guard, or in the constructor or destructor of the object:
+	//
+	//	{ trace_guard g; vec.push_back(p); }
+	//
+	// Debug builds throw ptr_exception when a traced_ptr is constructed or assigned otherwise.
+	class visitor
+	{
+		public:
+
+			void operator ()(const basic_ptr &p);
+			template <typename T> void operator ()(const compressed_ptr<T> &p) { visit(const_cast<unsigned &>(p.ref)); }
+
+		private:
+
+			visitor() { }
+			void visit(unsigned &ref);
+			friend class basic_ptr;
+			friend struct recycle_pool;
+	};
+
+	// Trace guard. While a thread holds one, no collector runs trace() methods, so the thread
+	// may change the storage they visit, such as reallocating a vector of traced_ptrs. Guards
+	// nest, and are meant to be held briefly: a collection waits for them. A thread holding a
+	// guard must not wait for a collection: collect() then returns 0, leaving the collection
+	// pending, and compact() throws ptr_exception. In real-time mode, it must not fork.
+	class trace_guard
+	{
+		public:
+
+			trace_guard();
+			~trace_guard();
+
+			trace_guard(const trace_guard &) = delete;
+			trace_guard &operator =(const trace_guard &) = delete;
+	};
+
+	// Root scope. While a scope is the innermost one of a thread, the roots it constructs on
+	// the stack take the next of nslots slots of a thread-local shadow stack instead of slots of
+	// the global roots registry: constructing and destroying them takes no lock, and the
+	// collector scans the slots as arrays. Slots may be released in any order; the last ones
+	// are popped. Roots beyond nslots are registered as usual, and those still alive when the
+	// scope ends, such as returned ones, are moved to the registry. Scopes nest, and end in
+	// reverse order of their beginning, as local variables do. At most 4096 slots per thread.
+	class root_scope
+	{
+		public:
+
+			explicit root_scope(unsigned nslots = 16);
+			~root_scope();
+
+			root_scope(const root_scope &) = delete;
+			root_scope &operator =(const root_scope &) = delete;
+
+		private:
+
+			unsigned base;		// Slots of the enclosing scope
+			unsigned limit;
+	};
+
 	// Initialization policy constants
 	struct initspec_t { bool zero; };
 	const initspec_t init_undef	{ false };
@@ -154,7 +498,7 @@ namespace gcptr
 				unsigned n = 0;
 				try
 				{ 
-					T *t = static_cast<T *>(alloc_begin(nelems, sizeof(T), destr, false));
+					T *t = static_cast<T *>(alloc_begin(nelems, sizeof(T), type, false));
 					for ( ; n < nelems ; n++ )
 						new(t++) T(std::forward<U>(first), std::forward<V>(rest)...);
 					alloc_end(n);
@@ -173,7 +517,7 @@ namespace gcptr
 				unsigned n = 0;
 				try
 				{ 
-					T *t = static_cast<T *>(alloc_begin(nelems, sizeof(T), destr, init.zero));
+					T *t = static_cast<T *>(alloc_begin(nelems, sizeof(T), type, init.zero));
 					if ( use_default_constructor<T>() )						
 						for ( ; n < nelems ; n++ )
 							new(t++) T();
@@ -194,7 +538,7 @@ namespace gcptr
 			{ 
 				try
 				{ 
-					T *t = static_cast<T *>(alloc_begin(1, sizeof(T), destr, false));
+					T *t = static_cast<T *>(alloc_begin(1, sizeof(T), type, false));
 					new(t) T(std::forward<U>(first), std::forward<V>(rest)...);
 					alloc_end(1);
 				}
@@ -206,12 +550,15 @@ namespace gcptr
 			}
 
 			// Allocate a single object without arguments. If the constant init_zero is passed as
-			// second argument, object memory is initialized to zero.
+			// second argument, object memory is initialized to zero. Otherwise objects of
+			// recycled types are taken from their pool if possible.
 			void alloc(initspec_t init = init_undef)
 			{
+				if ( recycled<T>::value && !init.zero && alloc_reuse(type) )
+					return;
 				try
 				{ 
-					T *t = static_cast<T *>(alloc_begin(1, sizeof(T), destr, init.zero));
+					T *t = static_cast<T *>(alloc_begin(1, sizeof(T), type, init.zero));
 					if ( use_default_constructor<T>() )						
 						new(t) T();
 					alloc_end(1);
@@ -223,6 +570,32 @@ namespace gcptr
 				}
 			}
 
+			// Allocate a single object with the given constructor arguments, in the same page as
+			// the object array of another smart pointer if possible. Without a reserved heap range
+			// (see heap_reserve()), same as alloc(). Blocks allocated by constructors are likewise
+			// placed near the object in construction.
+			template <typename... U>
+			void alloc_near(const basic_ptr &near, U&&... args)
+			{
+				try
+				{ 
+					T *t = static_cast<T *>(alloc_begin(1, sizeof(T), type, false, &near));
+					new(t) T(std::forward<U>(args)...);
+					alloc_end(1);
+				}
+				catch (...)
+				{ 
+					alloc_end(0);
+					throw; 
+				}
+			}
+
+		protected:
+
+			// Construct smart pointers that are neither roots nor members, see traced_ptr.
+			ptr(unlinked_t u) : basic_ptr(u) { }
+			ptr(const basic_ptr &src, unlinked_t u) : basic_ptr(src, u) { }
+
 		private:
 
 			// Pointer value as T *.
@@ -244,10 +617,245 @@ namespace gcptr
 					}
 			}
 
-			// Use array destructor only for types with non-trivial destructors
-			constexpr static destructor destr = use_destructor<T>() ? destroy : nullptr;
+			// Array tracer
+			static void trace(void *p, unsigned nelems, visitor &v)
+			{
+				T *t = static_cast<T *>(p);
+				while ( nelems-- )
+					(t++)->trace(v);
+			}
+
+			// Select the array tracer only for types with a trace() method
+			template <typename U, bool = has_trace<U>::value> struct tracer_of
+			{ constexpr static tracer fn = ptr<U>::trace; };
+			template <typename U> struct tracer_of<U, false>
+			{ constexpr static tracer fn = nullptr; };
+
+			// Object resetter
+			static void reset(void *p) { static_cast<T *>(p)->reset(); }
+
+			// Select the resetter only for recycled types
+			template <typename U, bool = recycled<U>::value> struct resetter_of
+			{ constexpr static resetter fn = ptr<U>::reset; };
+			template <typename U> struct resetter_of<U, false>
+			{ constexpr static resetter fn = nullptr; };
+
+			// Type descriptor.
+			// Use array destructor only for types with non-trivial destructors.
+			// Pointer-free types go to the no-scan space.
+			static const objtype type;
+	};
+
+	template <typename T> const objtype ptr<T>::type =
+	{
+		use_destructor<T>() ? destroy : nullptr,
+		tracer_of<T>::fn,
+		!no_scan<T>::value,
+		relocatable<T>::value,
+		false,
+		slab_cached<T>::value,
+		use_destructor<T>() && needs_finalization<T>::value,
+		resetter_of<T>::fn,
+		nullptr,
+		nullptr
+	};
+
+	// Smart pointer with atomic operations, for sharing between threads and building lock-free
+	// data structures. The collector takes care of memory reclamation: a value read by load()
+	// stays alive as long as the returned smart pointer refers to it, with no hazard pointers
+	// or epochs. Values must be null or point to the first element of an object array (as set
+	// by alloc()); other values throw ptr_exception. Operations are lock-free except while a
+	// collection is marking, when replaced and loaded values are handed to the collector.
+	template <typename T> class atomic_ptr : private basic_ptr
+	{
+		public:
+
+			atomic_ptr() = default;
+			atomic_ptr(const ptr<T> &p) { atomic_store(p); }
+			atomic_ptr(const atomic_ptr &) = delete;
+			atomic_ptr &operator =(const atomic_ptr &) = delete;
+
+			ptr<T> load() const
+			{
+				ptr<T> p;
+				atomic_load(p);
+				return p;
+			}
+
+			void store(const ptr<T> &p) { atomic_store(p); }
+
+			ptr<T> exchange(const ptr<T> &p)
+			{
+				ptr<T> old(p);
+				atomic_exchange(old);
+				return old;
+			}
+
+			// If the value equals expected, replace it by desired and return true.
+			// Otherwise load the value into expected and return false.
+			bool compare_exchange(ptr<T> &expected, const ptr<T> &desired)
+			{ 
+				return atomic_compare_exchange(expected, desired); 
+			}
+
+			operator ptr<T>() const { return load(); }
+			atomic_ptr &operator =(const ptr<T> &p) 
+			{ 
+				atomic_store(p); 
+				return *this; 
+			}
+	};
+
+	// Smart pointer held in storage not managed by the collector, typically the elements of
+	// a standard container member of a managed object. It is neither a root nor a member;
+	// the object that holds it must visit it from its trace() method, and change it under a
+	// trace_guard (see visitor). A traced_ptr held anywhere else, e.g. in a container on the
+	// stack or in a static, is never scanned: it doesn't keep its object array alive.
+	template <typename T> class traced_ptr : public ptr<T>
+	{
+		public:
+
+			traced_ptr() : ptr<T>(basic_ptr::unlinked_t()) { basic_ptr::guarded(); }
+			traced_ptr(const traced_ptr &src) : ptr<T>(src, basic_ptr::unlinked_t()) { basic_ptr::guarded(); }
+			traced_ptr(const ptr<T> &src) : ptr<T>(src, basic_ptr::unlinked_t()) { basic_ptr::guarded(); }
+			traced_ptr(T *p) : ptr<T>(basic_ptr::unlinked_t()) { basic_ptr::guarded(); ptr<T>::operator =(p); }
+
+			traced_ptr &operator =(const traced_ptr &src)
+			{
+				basic_ptr::guarded();
+				ptr<T>::operator =(src);
+				return *this;
+			}
+
+			traced_ptr &operator =(T *p)
+			{
+				basic_ptr::guarded();
+				ptr<T>::operator =(p);
+				return *this;
+			}
+	};
+
+	// Reference to an object array in the reserved heap range (see heap_reserve()), stored as a
+	// 32-bit scaled offset: an eighth of the size of a ptr. Like traced_ptr, it is neither a root
+	// nor a member, the collector only finds it through the trace() method of the object that
+	// holds it. An array referred to only by compressed_ptrs held elsewhere, such as locals or
+	// statics, or not visited by trace(), is garbage. Keep a ptr to it meanwhile. Values must
+	// be null or point to the first element of an array, as set by alloc(); other values throw
+	// ptr_exception. Private objects it refers to become shared.
+	template <typename T> class compressed_ptr
+	{
+		public:
+
+			compressed_ptr() : ref(0) { }
+			compressed_ptr(const ptr<T> &p) : ref(basic_ptr::compress(p)) { }
+
+			compressed_ptr(const compressed_ptr &p) : ref(p.ref) { }
+
+			compressed_ptr &operator =(const compressed_ptr &p)
+			{
+				basic_ptr::overwrite(ref);
+				ref = p.ref;
+				return *this;
+			}
+
+			compressed_ptr &operator =(const ptr<T> &p)
+			{
+				unsigned r = basic_ptr::compress(p);
+				basic_ptr::overwrite(ref);
+				ref = r;
+				return *this;
+			}
+
+			compressed_ptr &operator =(std::nullptr_t)
+			{
+				basic_ptr::overwrite(ref);
+				ref = 0;
+				return *this;
+			}
+
+			// Smart pointer to the referred array
+			operator ptr<T>() const
+			{
+				ptr<T> p;
+				p.expand(ref);
+				return p;
+			}
+
+			// Pointer operations
+			T *get() const { return static_cast<T *>(basic_ptr::address(ref)); }
+			T *operator ->() const { check(); return get(); }
+			T &operator *() const { check(); return *get(); }
+			T &operator [](int n) const { check(); return get()[n]; }
+			explicit operator bool() const { return ref != 0; }
+			bool operator ==(const compressed_ptr &p) const { return ref == p.ref; }
+			bool operator !=(const compressed_ptr &p) const { return ref != p.ref; }
+
+		private:
+
+			void check() const { if ( !ref ) throw ptr_exception("dereferencing null ptr"); }
+
+			unsigned ref;
+			friend class visitor;
+	};
+
+	// Thread-private objects handed over to another thread without copies (see thread_private()).
+	// The parcel takes the blocks accessible from a smart pointer out of the heap of the sending
+	// thread, provided that no other root of that thread can reach them, and the receiving thread
+	// opens it to move them into its own heap. Pass the parcel itself by any means, e.g. a queue
+	// under a mutex. Objects that were shared travel as they are.
+	template <typename T> class parcel : private ptr<T>
+	{
+		public:
+
+			parcel() : heap(nullptr) { }
+
+			// Pack the objects accessible from p, which is reset.
+			explicit parcel(ptr<T> &p) : heap(nullptr) { heap = this->pack(p); }
+
+			parcel(parcel &&src) : ptr<T>(src), heap(src.heap)
+			{
+				src.heap = nullptr;
+				src.detach();
+				src.ptr<T>::operator =(nullptr);
+			}
+
+			// Hand over the objects of src; those this parcel held are delivered to this thread
+			// as by open().
+			parcel &operator =(parcel &&src)
+			{
+				if ( this == &src )
+					return *this;
+				basic_ptr::unpack(heap);
+				ptr<T>::operator =(src);
+				heap = src.heap;
+				src.heap = nullptr;
+				src.detach();
+				src.ptr<T>::operator =(nullptr);
+				return *this;
+			}
+
+			parcel &operator =(const parcel &) = delete;
+
+			// Take delivery: the objects become private to this thread, if enabled, or shared.
+			ptr<T> open()
+			{
+				basic_ptr::unpack(heap);
+				heap = nullptr;
+				ptr<T> p(*this);
+				this->detach();
+				ptr<T>::operator =(nullptr);
+				return p;
+			}
+
+			// Tells whether the parcel holds objects.
+			explicit operator bool() const { return this->pval != nullptr; }
+
+			~parcel() { basic_ptr::unpack(heap); }
+
+		private:
+
+			local_heap *heap;
 	};
-	
 }
 
 #endif
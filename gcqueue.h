@@ -0,0 +1,89 @@
+#ifndef GCQUEUE_H
+#define GCQUEUE_H
+
+#include "gcptr.h"
+
+namespace gcptr
+{
+	// Lock-free multi-producer/multi-consumer FIFO queue (Michael & Scott).
+	// Nodes are garbage-collected blocks linked by atomic smart pointers, so dequeued nodes
+	// are reclaimed by the collector once no thread refers to them: there is no ABA problem
+	// and no need for hazard pointers or epochs.
+	template <typename T> class concurrent_queue
+	{
+		public:
+
+			concurrent_queue()
+			{
+				ptr<node> dummy;
+				dummy.alloc();
+				head.store(dummy);
+				tail.store(dummy);
+			}
+
+			concurrent_queue(const concurrent_queue &) = delete;
+			concurrent_queue &operator =(const concurrent_queue &) = delete;
+
+			// Append a value constructed from the arguments.
+			template <typename... U> void push(U&&... args)
+			{
+				ptr<node> n;
+				n.alloc(std::forward<U>(args)...);
+				for ( ;; )
+				{
+					ptr<node> t = tail.load();
+					ptr<node> next = t->next.load();
+					if ( next )							// Tail is lagging, help move it
+					{
+						tail.compare_exchange(t, next);
+						continue;
+					}
+					if ( t->next.compare_exchange(next, n) )
+					{
+						tail.compare_exchange(t, n);
+						return;
+					}
+				}
+			}
+
+			// Remove the first value and copy it to val. Returns false if the queue is empty.
+			bool pop(T &val)
+			{
+				for ( ;; )
+				{
+					ptr<node> h = head.load();
+					ptr<node> next = h->next.load();
+					if ( !next )
+						return false;
+					ptr<node> t = tail.load();
+					if ( h == t )						// Tail is lagging, help move it
+					{
+						tail.compare_exchange(t, next);
+						continue;
+					}
+					val = next->val;					// Node stays alive while we hold it
+					if ( head.compare_exchange(h, next) )
+						return true;
+				}
+			}
+
+			// Tells whether the queue is empty.
+			bool empty() const { return !head.load()->next.load(); }
+
+		private:
+
+			struct node
+			{
+				node() : val() { }
+				template <typename... U> node(U&&... args) : val(std::forward<U>(args)...) { }
+
+				T val;
+				atomic_ptr<node> next;
+			};
+
+			atomic_ptr<node> head;		// Dummy node, its successor holds the first value
+			atomic_ptr<node> tail;		// Last or next to last node
+	};
+}
+
+#endif
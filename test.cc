@@ -1,6 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <string>
 #include <thread>
+#include <vector>
 #include "gcptr.h"
+#include "gcmap.h"
+#include "gcqueue.h"
+#include "gcpersist.h"
+#include "gcpool.h"
 
 using namespace std;
 using namespace gcptr;
@@ -55,6 +67,990 @@ C::C(ptr<A> root): p(root) { puts("const C"); }
 
 C::~C() { printf("dest C %p\n", this); }
 
+// Graph node keeping its neighbours in a vector. The vector elements live in
+// malloc memory, so they are traced_ptrs visited by trace() instead of roots,
+// and the vector changes under a trace guard.
+
+struct N
+{
+	~N() { printf("dest N %p\n", this); }
+	void trace(visitor &v) { for ( auto &p : adj ) v(p); }
+	vector<traced_ptr<N>> adj;
+};
+
+// Checks print their outcome; main returns the number of failures.
+
+unsigned failures;
+
+void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if ( !ok )
+		failures++;
+}
+
+// Run checks in a child process, for settings that must precede any allocation
+void in_child(void (*test)(), const char *what)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if ( !pid )
+	{
+		test();
+		fflush(stdout);
+		_exit(failures);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0, what);
+}
+
+// Pointer-free by mistake: the member is never scanned.
+
+struct Leaky { ptr<int> p; };
+
+namespace gcptr { template <> struct no_scan<Leaky> : std::true_type { }; }
+
+void test_no_scan()
+{
+	bool thrown = false;
+	try
+	{
+		ptr<Leaky> l;
+		l.alloc();
+	}
+	catch (ptr_exception e)
+	{
+		thrown = true;
+	}
+	collect();
+	check(thrown, "member in a no-scan object throws");
+}
+
+// A vector of traced pointers grows while another thread collects
+
+struct Q
+{
+	void trace(visitor &v) { for ( auto &p : adj ) v(p); }
+	vector<traced_ptr<Q>> adj;
+};
+
+void test_trace_guard()
+{
+	ptr<Q> hub;
+	hub.alloc();
+	atomic<bool> done(false);
+	atomic<unsigned> cycles(0);
+	thread collector([&] { for ( ; !done ; cycles++ ) { collect(); this_thread::sleep_for(chrono::milliseconds(1)); } });
+	unsigned count = 0;
+	for ( ; count < 2000 || cycles < 20 ; count++ )
+	{
+		ptr<Q> n;
+		n.alloc();
+		trace_guard g;
+		hub->adj.push_back(n);
+	}
+	done = true;
+	collector.join();
+	collect();
+	bool alive = hub->adj.size() == count;
+	for ( auto &p : hub->adj )
+		alive = alive && p->adj.empty();
+	check(alive, "traced pointers survive collections during reallocation");
+
+	bool thrown = false;
+	try
+	{
+		hub->adj.push_back(hub);
+	}
+	catch (ptr_exception e)
+	{
+		thrown = true;
+	}
+	check(thrown, "traced pointer changed without a guard throws");
+	hub.detach();
+	collect();
+}
+
+// Atomic pointer in a shared object, stored, exchanged and loaded while another thread
+// collects. A destroyed cell is recognized by its value.
+
+struct Cell
+{
+	Cell(int v) : v(v) { }
+	~Cell() { v = -1; }
+	int v;
+};
+
+struct Box { atomic_ptr<Cell> cell; };
+
+void test_atomic_ptr()
+{
+	ptr<Box> box;
+	box.alloc();
+	ptr<Cell> first;
+	first.alloc(1);
+	box->cell.store(first);
+	first.detach();
+
+	atomic<bool> done(false), ok(true);
+	vector<thread> th;
+	for ( int t = 0 ; t < 3 ; t++ )
+		th.push_back(thread([&, t]
+		{
+			for ( int i = 1 ; !done ; i++ )
+			{
+				ptr<Cell> c;
+				c.alloc(i);
+				if ( t == 0 )
+					box->cell.store(c);
+				else if ( t == 1 )
+					c = box->cell.exchange(c);
+				else
+					c = box->cell.load();
+				this_thread::yield();
+				if ( c->v <= 0 )
+					ok = false;
+			}
+		}));
+	for ( int i = 0 ; i < 30 ; i++ )
+	{
+		collect();
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	done = true;
+	for ( auto &t : th )
+		t.join();
+	collect();
+	ptr<Cell> last = box->cell.load();
+	check(ok && last->v > 0, "atomic_ptr values survive concurrent collections");
+	box.detach();
+	last.detach();
+	collect();
+}
+
+// Queue fed by several producers while collections run: each producer's values come out in
+// the order they went in, and none is lost.
+
+void test_queue()
+{
+	const int producers = 3, count = 20000;
+	concurrent_queue<pair<int, int>> q;
+	vector<thread> th;
+	for ( int p = 0 ; p < producers ; p++ )
+		th.push_back(thread([&q, p]
+		{
+			for ( int i = 0 ; i < count ; i++ )
+				q.push(p, i);
+		}));
+	vector<int> next(producers, 0);
+	bool ordered = true;
+	for ( int received = 0 ; received < producers * count ; )
+	{
+		pair<int, int> v;
+		if ( !q.pop(v) )
+		{
+			this_thread::yield();
+			continue;
+		}
+		ordered = ordered && v.second == next[v.first]++;
+		if ( ++received % 10000 == 0 )
+			collect();
+	}
+	for ( auto &t : th )
+		t.join();
+	check(ordered && q.empty(), "queue keeps the order of each producer");
+}
+
+// Map with short chains of shared nodes, checked after collections
+
+void test_map()
+{
+	concurrent_map<int, int> m(16);
+	bool ok = true;
+	for ( int i = 0 ; i < 1000 ; i++ )
+		ok = ok && m.insert(i, i * 2);
+	ok = ok && !m.insert(7, 70);
+	collect();
+	for ( int i = 0 ; i < 1000 ; i++ )
+	{
+		int v;
+		ok = ok && m.find(i, v) && v == (i == 7 ? 70 : i * 2);
+	}
+	for ( int i = 0 ; i < 1000 ; i += 2 )
+		ok = ok && m.erase(i);
+	ok = ok && !m.erase(0);
+	collect();
+	for ( int i = 0 ; i < 1000 ; i++ )
+	{
+		int v = -1;
+		ok = ok && m.find(i, v) == (i % 2 == 1) && (i % 2 == 0 || v == (i == 7 ? 70 : i * 2));
+	}
+	check(ok, "map insert, find and erase across collections");
+}
+
+// Persistent map versions across collections: keys of a constant hash go to a collision
+// node, and keys 1 and 33 of the identity hash share a subnode until one is erased and the
+// other is pulled up.
+
+struct ConstHash { size_t operator ()(int) const { return 42; } };
+
+void test_persistent_map()
+{
+	persistent_map<int, int, ConstHash> c;
+	for ( int i = 0 ; i < 10 ; i++ )
+		c = c.set(i, i * 3);
+	persistent_map<int, int, ConstHash> c8 = c.erase(8).erase(3);
+	collect();
+	bool ok = c.size() == 10 && c8.size() == 8;
+	for ( int i = 0 ; i < 10 ; i++ )
+	{
+		int v;
+		ok = ok && c.find(i, v) && v == i * 3 && c8.find(i, v) == (i != 8 && i != 3);
+	}
+	check(ok, "persistent map collision node");
+
+	persistent_map<int, int> m = persistent_map<int, int>().set(1, 10).set(33, 330).set(2, 20);
+	persistent_map<int, int> pulled = m.erase(33);
+	collect();
+	int v1 = 0, v33 = 0, v2 = 0;
+	ok = pulled.size() == 2 && pulled.find(1, v1) && v1 == 10 && !pulled.find(33, v33) &&
+		pulled.find(2, v2) && v2 == 20 && m.find(33, v33) && v33 == 330;
+	pulled = pulled.erase(1).erase(2);
+	collect();
+	check(ok && pulled.size() == 0 && !pulled.find(1, v1), "persistent map erase pulls up a leaf");
+}
+
+// Persistent vector versions across growth past one leaf and one level of inner nodes
+
+void test_persistent_vector()
+{
+	persistent_vector<int> v, v32, v1024;
+	for ( int i = 0 ; i < 1100 ; i++ )
+	{
+		if ( i == 32 )
+			v32 = v;
+		if ( i == 1024 )
+			v1024 = v;
+		v = v.push_back(i);
+	}
+	persistent_vector<int> w = v.set(1050, -1).set(5, -5);
+	collect();
+	bool ok = v.size() == 1100 && v32.size() == 32 && v1024.size() == 1024 && w.size() == 1100;
+	for ( unsigned i = 0 ; i < v.size() ; i++ )
+		ok = ok && v[i] == int(i) && w[i] == (i == 5 ? -5 : i == 1050 ? -1 : int(i)) &&
+			(i >= 32 || v32[i] == int(i)) && (i >= 1024 || v1024[i] == int(i));
+	check(ok, "persistent vector growth and updates");
+}
+
+// Pool tasks building lists while collections run at the safepoints, in the eager and lazy
+// sweep modes.
+
+struct Link
+{
+	Link(int v, const ptr<Link> &next) : v(v), next(next) { }
+	int v;
+	ptr<Link> next;
+};
+
+void test_task_pool()
+{
+	unsigned thr = collect_threshold(64 * 1024);
+	atomic<unsigned> bad(0);
+	for ( auto mode : { sweep_eager, sweep_lazy } )
+	{
+		collect_sweep_mode(mode);
+		task_pool pool(4);
+		for ( int t = 0 ; t < 200 ; t++ )
+			pool.submit([&bad, t]
+			{
+				ptr<Link> head;
+				for ( int i = 0 ; i < 500 ; i++ )
+				{
+					ptr<Link> l;
+					l.alloc(t + i, head);
+					head = l;
+				}
+				int sum = 0;
+				for ( ptr<Link> l = head ; l ; l = l->next )
+					sum += l->v;
+				if ( sum != 500 * t + 499 * 500 / 2 )
+					bad++;
+			});
+		pool.wait();
+	}
+	collect_sweep_mode(sweep_eager);
+	collect_threshold(thr);
+	collect();
+	check(!bad, "pool tasks allocate across collections");
+}
+
+// Real-time collections while traced elements move between the vectors of two holders, which
+// reallocate: every element stays referenced, so none may be destroyed. Many blocks hang from
+// each holder, so that elements move while the collector marks between the two.
+unsigned moved_dead;
+
+struct Moved
+{
+	Moved(int v) : v(v) { }
+	~Moved() { v = -1; moved_dead++; }
+	int v;
+};
+
+struct Ballast
+{
+	ptr<Ballast> next;
+};
+
+struct Bin
+{
+	void trace(visitor &vis) { for ( auto &p : v ) vis(p); }
+	vector<traced_ptr<Moved>> v;
+	ptr<Ballast> ballast;
+};
+
+void test_moving_traced()
+{
+	const int n = 200;
+	ptr<Bin> bins[2];
+	bins[0].alloc();
+	bins[1].alloc();
+	for ( auto &b : bins )
+	{
+		b->ballast.alloc_array(20000);
+		for ( int i = 0 ; i < 20000 ; i++ )
+			b->ballast[i].next.alloc();
+	}
+	for ( int i = 0 ; i < n ; i++ )
+	{
+		ptr<Moved> m;
+		m.alloc(i);
+		trace_guard g;
+		bins[0]->v.push_back(m);
+	}
+
+	moved_dead = 0;
+	collect_realtime(true);
+	for ( int round = 0 ; round < 40000 ; round++ )
+	{
+		ptr<char> garbage;
+		garbage.alloc_array(256);
+		Bin &from = *bins[round / n % 2], &to = *bins[1 - round / n % 2];
+		trace_guard g;
+		to.v.push_back(from.v.back());
+		from.v.pop_back();
+		if ( to.v.size() % 64 == 1 )
+			to.v.shrink_to_fit();				// Reallocate
+	}
+	collect_realtime(false);
+	collect();
+
+	long sum = 0;
+	for ( auto &b : bins )
+		for ( auto &p : b->v )
+			sum += p->v;
+	check(moved_dead == 0 && sum == long(n) * (n - 1) / 2, "traced elements moved during real-time collections survive");
+	bins[0].detach();
+	bins[1].detach();
+	collect();
+	check(moved_dead == n, "moved elements collected once unreferenced");
+}
+
+// Thread-private objects: garbage freed by collect_private(), reachable objects kept,
+// escape into a shared object and into its traced vector, and an object in construction
+// keeping its member alive.
+
+unsigned tracked_dead;
+
+struct Tracked
+{
+	Tracked(int v) : v(v) { }
+	~Tracked() { v = -1; tracked_dead++; }
+	int v;
+};
+
+struct Holder
+{
+	Holder() { }
+	Holder(ptr<Tracked> &src) : keep(src)
+	{
+		src.detach();
+		collect_private();			// keep is the only reference
+	}
+	void trace(visitor &vis) { for ( auto &p : vec ) vis(p); }
+	ptr<Tracked> keep;
+	ptr<Holder> next;
+	vector<traced_ptr<Tracked>> vec;
+};
+
+void test_private()
+{
+	ptr<Holder> shared_holder;
+	shared_holder.alloc();
+	thread_private(true);
+
+	{
+		ptr<Tracked> g;
+		g.alloc(1);
+	}
+	unsigned dead = tracked_dead;
+	collect_private();
+	check(tracked_dead == dead + 1, "private garbage freed by collect_private");
+
+	ptr<Tracked> kept;
+	kept.alloc(2);
+	collect_private();
+	collect();
+	check(kept->v == 2, "reachable private object survives collections");
+
+	ptr<Holder> escaping;
+	escaping.alloc();
+	escaping->keep.alloc(3);
+	shared_holder->next = escaping;		// Promotes both
+	escaping.detach();
+	collect_private();
+	collect();
+	check(shared_holder->next->keep->v == 3, "private objects escaping into a shared object survive");
+
+	ptr<Tracked> element;
+	element.alloc(5);
+	{
+		trace_guard g;
+		shared_holder->vec.push_back(element);
+	}
+	element.detach();
+	collect_private();
+	collect();
+	check(shared_holder->vec[0]->v == 5, "private object pushed into a traced vector of a shared object survives");
+
+	ptr<Tracked> src;
+	src.alloc(4);
+	dead = tracked_dead;
+	ptr<Holder> h;
+	h.alloc(src);
+	check(tracked_dead == dead && h->keep->v == 4, "object in construction keeps its private member");
+
+	thread_private(false);
+	collect();
+
+	// The exit of a thread shares its private blocks: a root of this thread keeps them alive,
+	// and the global collector frees them once unreachable.
+	ptr<Holder> handed;
+	dead = tracked_dead;
+	thread t([&handed] {
+		thread_private(true);
+		handed.alloc();
+		handed->keep.alloc(6);
+		ptr<Tracked> g;
+		g.alloc(7);
+	});
+	t.join();
+	collect();
+	check(tracked_dead == dead + 1 && handed->keep->v == 6, "private blocks shared at thread exit");
+	handed.detach();
+	collect();
+	check(tracked_dead == dead + 2, "shared blocks of an exited thread collected");
+}
+
+// Slab caches: the slots of collected objects are reused by objects of their type only, even
+// by a type of the same size.
+struct SlabA { long a, b; };
+struct SlabB { long a, b; };
+
+namespace gcptr
+{
+	template <> struct slab_cached<SlabA> : std::true_type { };
+	template <> struct slab_cached<SlabB> : std::true_type { };
+}
+
+template <typename T> set<void *> slab_slots(unsigned n)
+{
+	vector<ptr<T>> objs(n);
+	set<void *> slots;
+	for ( auto &p : objs )
+	{
+		p.alloc();
+		slots.insert(&*p);
+	}
+	return slots;
+}
+
+void test_slab()
+{
+	set<void *> a = slab_slots<SlabA>(1000);
+	collect();
+	set<void *> b = slab_slots<SlabB>(1000);
+	collect();
+	set<void *> again = slab_slots<SlabA>(1000);
+	collect();
+	unsigned shared = 0, reused = 0;
+	for ( auto p : b )
+		shared += a.count(p);
+	for ( auto p : again )
+		reused += a.count(p);
+	check(shared == 0 && reused == 1000, "slab slots reused by type");
+}
+
+// Root scopes: scoped roots survive collections, including roots beyond the slots of the
+// scope, roots released out of order, and a root returned out of its scope.
+ptr<Tracked> make_scoped(int v)
+{
+	root_scope rs(4);
+	ptr<Tracked> p;
+	p.alloc(v);
+	collect();
+	return p;
+}
+
+void test_root_scope()
+{
+	unsigned dead = tracked_dead;
+	ptr<Tracked> returned = make_scoped(10);
+	bool ok = true;
+	{
+		root_scope rs(4);
+		ptr<Tracked> roots[6];					// Two beyond the slots of the scope
+		for ( int i = 0 ; i < 6 ; i++ )
+			roots[i].alloc(i);
+		alignas(ptr<Tracked>) char buf[2][sizeof(ptr<Tracked>)];
+		ptr<Tracked> *first = new(buf[0]) ptr<Tracked>, *second = new(buf[1]) ptr<Tracked>;
+		first->alloc(6);
+		second->alloc(7);
+		first->~ptr<Tracked>();					// Released before the slot above it
+		collect();
+		ok = ok && (*second)->v == 7 && tracked_dead == dead + 1;
+		second->~ptr<Tracked>();
+		for ( int i = 0 ; i < 6 ; i++ )
+			ok = ok && roots[i]->v == i;
+		returned = make_scoped(11);
+	}
+	collect();
+	check(ok && returned->v == 11 && tracked_dead == dead + 9, "scoped roots survive collections");
+	returned.detach();
+	collect();
+	check(tracked_dead == dead + 10, "scoped roots collected once released");
+}
+
+// Parcels: a private list packed by one thread and opened by another, which walks it across
+// collections, and a pack of objects another root still reaches.
+struct PNode
+{
+	PNode(int v, const ptr<PNode> &next) : v(v), next(next) { }
+	~PNode() { v = -1; }
+	int v;
+	ptr<PNode> next;
+};
+
+void test_parcel()
+{
+	parcel<PNode> pc;
+	thread([&]
+	{
+		thread_private(true);
+		ptr<PNode> head;
+		for ( int i = 0 ; i < 100 ; i++ )
+		{
+			ptr<PNode> n;
+			n.alloc(i, head);
+			head = n;
+		}
+		pc = parcel<PNode>(head);
+		check(!head && pc, "private list packed");
+
+		ptr<PNode> other, alias;
+		other.alloc(0, ptr<PNode>());
+		alias = other;
+		bool thrown = false;
+		try
+		{
+			parcel<PNode> bad(other);
+		}
+		catch (ptr_exception e)
+		{
+			thrown = true;
+		}
+		check(thrown && other, "packing objects another root reaches throws");
+		thread_private(false);
+	}).join();
+
+	collect();
+	thread([&]
+	{
+		thread_private(true);
+		ptr<PNode> head = pc.open();
+		for ( int i = 0 ; i < 1000 ; i++ )
+			ptr<PNode>().alloc(i, ptr<PNode>());
+		collect_private();
+		collect();
+		int expect = 99;
+		for ( ptr<PNode> n = head ; n ; n = n->next )
+			if ( n->v == expect )
+				expect--;
+		check(!pc && expect == -1, "parcel opened in another thread survives collections");
+		thread_private(false);
+	}).join();
+	collect();
+}
+
+// Reserved heap range: compressed references, and arrays of mixed sizes reusing the free
+// chunks of collected ones and of the placement windows.
+
+struct CNode
+{
+	CNode(int v, const ptr<CNode> &next) : v(v), next(next) { }
+	void trace(visitor &vis) { vis(next); }
+	int v;
+	compressed_ptr<CNode> next;
+};
+
+void test_heap_reserve()
+{
+	check(heap_reserve(size_t(1) << 30), "heap reserved");
+
+	ptr<CNode> head;
+	for ( int i = 0 ; i < 1000 ; i++ )
+	{
+		ptr<CNode> n;
+		n.alloc(i, head);
+		head = n;
+	}
+	collect();
+	int expect = 999;
+	for ( ptr<CNode> n = head ; n ; n = n->next )
+		if ( n->v == expect )
+			expect--;
+	compressed_ptr<CNode> c(head), none;
+	check(expect == -1 && sizeof(c) == 4 && ptr<CNode>(c) == head && !none && c->v == 999,
+		"compressed_ptr round-trips");
+
+	vector<ptr<unsigned char>> arrays(2000);
+	vector<unsigned> sizes(arrays.size());
+	vector<ptr<CNode>> near(arrays.size());
+	for ( int round = 0 ; round < 3 ; round++ )
+	{
+		for ( unsigned i = round % 2 ; i < arrays.size() ; i += 2 )
+		{
+			sizes[i] = 1 + (i * 7919 + round * 104729) % 12000;
+			arrays[i].alloc_array(sizes[i]);
+			for ( unsigned j = 0 ; j < sizes[i] ; j++ )
+				arrays[i][j] = (unsigned char)(i + j);
+			near[i].alloc_near(near[i ^ 1], int(i), ptr<CNode>());
+		}
+		collect();
+	}
+	bool intact = true;
+	for ( unsigned i = 0 ; i < arrays.size() ; i++ )
+	{
+		for ( unsigned j = 0 ; j < sizes[i] ; j++ )
+			intact = intact && arrays[i][j] == (unsigned char)(i + j);
+		intact = intact && (!near[i] || near[i]->v == int(i));
+	}
+	check(intact, "arrays of mixed sizes don't overlap");
+}
+
+// Mark-region heap: after a collection, allocations reuse the lines freed in the regions
+// of the first ones, which are partly live. Run in a child, before any allocation.
+void test_regions()
+{
+	check(heap_regions(), "mark-region heap");
+	vector<ptr<long>> keep;
+	uintptr_t lo = uintptr_t(-1), hi = 0;
+	for ( int i = 0 ; i < 20000 ; i++ )
+	{
+		ptr<long> p;
+		p.alloc();
+		*p = i;
+		lo = min(lo, uintptr_t(&*p));
+		hi = max(hi, uintptr_t(&*p));
+		if ( i % 10 == 0 )
+			keep.push_back(p);
+	}
+	collect();
+
+	unsigned reused = 0;
+	for ( int i = 0 ; i < 10000 ; i++ )
+	{
+		ptr<long> p;
+		p.alloc();
+		reused += uintptr_t(&*p) >= lo && uintptr_t(&*p) <= hi;
+	}
+	bool intact = true;
+	for ( unsigned i = 0 ; i < keep.size() ; i++ )
+		intact = intact && *keep[i] == long(i * 10);
+	check(reused > 5000 && intact, "regions reused after a sweep");
+}
+
+// Forks while other threads hold roots and allocate, in the fork-friendly heap, with the
+// real-time collector and background sweeper running. Each child collects and walks the list
+// of the forking thread.
+void test_fork()
+{
+	check(heap_reserve(size_t(1) << 30) && heap_fork_friendly(), "fork-friendly heap");
+	collect_realtime(true);
+	collect_sweep_mode(sweep_background);
+
+	ptr<CNode> head;
+	for ( int i = 0 ; i < 1000 ; i++ )
+	{
+		ptr<CNode> n;
+		n.alloc(i, head);
+		head = n;
+	}
+
+	atomic<bool> stop(false);
+	vector<thread> workers;
+	for ( int t = 0 ; t < 3 ; t++ )
+		workers.push_back(thread([&]
+		{
+			ptr<CNode> mine;
+			for ( int i = 0 ; !stop ; i++ )
+			{
+				ptr<CNode> n;
+				n.alloc(i, i % 1000 ? mine : ptr<CNode>());
+				mine = n;
+			}
+		}));
+
+	bool ok = true;
+	for ( int k = 0 ; k < 20 ; k++ )
+	{
+		usleep(2000);
+		fflush(stdout);
+		pid_t pid = fork();
+		if ( !pid )
+		{
+			collect();
+			for ( int i = 0 ; i < 10000 ; i++ )
+				ptr<CNode>().alloc(i, ptr<CNode>());
+			collect();
+			int expect = 999;
+			for ( ptr<CNode> n = head ; n ; n = n->next )
+				if ( n->v == expect )
+					expect--;
+			_exit(expect == -1 ? 0 : 1);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	stop = true;
+	for ( auto &w : workers )
+		w.join();
+	check(ok, "children forked while other threads hold roots collect");
+}
+
+// Fast exit in a child, which reports to the parent through a pipe: 'f' for each finalized
+// object, and 'c' if collect() from a static destructor returned at once without collecting.
+int exit_pipe;
+
+struct Final
+{
+	~Final() { if ( write(exit_pipe, "f", 1) != 1 ) _exit(1); }
+};
+
+namespace gcptr { template <> struct needs_finalization<Final> : std::true_type { }; }
+
+struct ExitCollector
+{
+	~ExitCollector()
+	{
+		auto start = chrono::steady_clock::now();
+		bool idle = !collect() && chrono::steady_clock::now() - start < chrono::milliseconds(10);
+		if ( write(exit_pipe, idle ? "c" : "x", 1) != 1 )
+			_exit(1);
+	}
+};
+
+void test_fast_exit()
+{
+	int fds[2];
+	if ( pipe(fds) )
+	{
+		check(false, "pipe");
+		return;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if ( !pid )
+	{
+		close(fds[0]);
+		exit_pipe = fds[1];
+		static ExitCollector ec;				// Destroyed after the fast exit
+		fast_exit(true);
+		ptr<Final> kept;
+		kept.alloc();
+		ptr<Final>().alloc();
+		for ( int i = 0 ; i < 1000 ; i++ )		// Garbage a collection would free
+			ptr<int>().alloc(i);
+		exit(0);
+	}
+	close(fds[1]);
+	string got;
+	char c;
+	while ( read(fds[0], &c, 1) == 1 )
+		got += c;
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child exits");
+	check(got == "ffc", "fast exit finalizes, and collect() from a static destructor returns at once");
+}
+
+// Compaction of a list linked in shuffled order, with a traced pointer and a root into it
+
+struct RNode
+{
+	RNode(int v) : v(v) { }
+	void trace(visitor &vis) { for ( auto &p : extra ) vis(p); }
+	int v;
+	ptr<RNode> next;
+	vector<traced_ptr<RNode>> extra;
+};
+
+namespace gcptr { template <> struct relocatable<RNode> : std::true_type { }; }
+
+void test_compact()
+{
+	const int n = 5000;
+	vector<ptr<RNode>> nodes(n);
+	for ( int i = 0 ; i < n ; i++ )
+		nodes[i].alloc(i);
+	ptr<RNode> head = nodes[0];
+	for ( int i = 1, j = 0 ; i < n ; i++ )
+	{
+		int k = (i * 2039) % n;				// 2039 is prime to n: a permutation
+		nodes[j]->next = nodes[k];
+		j = k;
+	}
+	{
+		trace_guard g;
+		head->extra.push_back(nodes[n / 2]);
+	}
+	ptr<RNode> middle = nodes[n / 3];
+	RNode *before = &*middle;
+	nodes.clear();
+
+	unsigned moved = compact();
+	int count = 0;
+	bool ok = moved > 0 && &*middle != before && middle->v == n / 3 &&
+		head->extra[0]->v == n / 2;
+	for ( ptr<RNode> p = head ; p ; p = p->next, count++ )
+		ok = ok && p->v == (count * 2039) % n;
+	check(ok && count == n, "pointers dereference correctly after compact");
+	head.detach();
+	middle.detach();
+	collect();
+}
+
+// Disposal: new shared and private arrays are freed at once; older shared arrays, arrays in
+// construction and accessible arrays are not.
+atomic<int> disposed;
+
+struct Disposable
+{
+	~Disposable() { disposed++; }
+};
+
+struct Builder
+{
+	Builder()
+	{
+		ptr<Disposable> inner;
+		inner.alloc();
+		freed = inner.dispose();
+	}
+	bool freed;
+};
+
+void test_dispose()
+{
+	disposed = 0;
+	ptr<Disposable> p;
+	p.alloc();
+	bool freed = p.dispose();
+	check(freed && disposed == 1 && !p, "new shared array freed at once");
+
+	thread([]
+	{
+		thread_private(true);
+		ptr<Disposable> q;
+		q.alloc();
+		bool freed = q.dispose();
+		check(freed && disposed == 2 && !q, "private array freed at once");
+		thread_private(false);
+	}).join();
+
+	p.alloc();
+	collect();
+	freed = p.dispose();
+	collect();
+	check(!freed && !p && disposed == 3, "older shared array left to the collector");
+
+	ptr<Builder> b;
+	b.alloc();
+	check(!b->freed && disposed == 3, "array in construction left to the collector");
+	collect();
+	check(disposed == 4, "array in construction collected");
+
+	bool thrown = false;
+	p.alloc();
+	ptr<Disposable> other = p;
+	try
+	{
+		p.dispose();
+	}
+	catch (ptr_exception e)
+	{
+		thrown = true;
+	}
+	check(thrown && p == other && disposed == 4, "disposing of an accessible array throws");
+	p.detach();
+	other.detach();
+	b.detach();
+	collect();
+}
+
+// Recycling: a swept object is cleared and reset into the pool of its type, and alloc() takes
+// it back
+atomic<int> resets;
+
+struct Pooled
+{
+	void reset() { resets++; v = 0; }
+	void trace(visitor &vis) { vis(traced); }
+	int v = 0;
+	ptr<Disposable> member;
+	traced_ptr<Disposable> traced;
+};
+
+namespace gcptr { template <> struct recycled<Pooled> : std::true_type { }; }
+
+void test_recycle()
+{
+	disposed = 0;
+	resets = 0;
+	ptr<Pooled> p;
+	p.alloc();
+	Pooled *first = &*p;
+	p->v = 7;
+	p->member.alloc();
+	{
+		trace_guard g;
+		ptr<Disposable> d;
+		d.alloc();
+		p->traced = traced_ptr<Disposable>(d);
+	}
+	p.detach();
+	collect();
+	check(resets == 1 && disposed == 2, "swept object reset into the pool, its pointers' arrays freed");
+
+	p.alloc();
+	check(&*p == first && resets == 1 && p->v == 0 && !p->member && !p->traced,
+		"alloc() takes the pooled object back, cleared");
+	p.detach();
+	collect();
+}
+
 void body()
 {
 	try
@@ -105,6 +1101,22 @@ void body()
 		ppa2.detach();
 		puts("detach ppa2");
 		collect();				// Array should be deleted here
+
+		// Create a cycle of 2 nodes through their adjacency vectors
+		ptr<N> n0, n1;
+		n0.alloc();
+		n1.alloc();
+		{
+			trace_guard g;
+			n0->adj.push_back(n1);
+			n1->adj.push_back(n0);
+		}
+		puts("cycle through vectors");
+		collect();				// Both nodes are accessible
+		n0.detach();
+		n1.detach();
+		puts("detach n0, n1");
+		collect();				// Both nodes should be deleted here
 	}
 	catch (ptr_exception e)
 	{
@@ -121,6 +1133,12 @@ int main(int argc, char *argv[])
 	if ( !nthr )
 		nthr = 1;
 
+	// Checks in child processes, before any allocation
+	in_child(test_heap_reserve, "heap_reserve checks in a child");
+	in_child(test_regions, "mark-region checks in a child");
+	in_child(test_fork, "fork checks in a child");
+	test_fast_exit();
+
 	// Run and join threads
 	thread th[nthr];
 	for ( unsigned i = 0 ; i < nthr ; i++ )
@@ -128,5 +1146,24 @@ int main(int argc, char *argv[])
 	for ( unsigned i = 0 ; i < nthr ; i++ )
 		th[i].join();
 
-	return 0;
+	// Single-threaded checks
+	test_no_scan();
+	test_trace_guard();
+	test_atomic_ptr();
+	test_queue();
+	test_map();
+	test_persistent_map();
+	test_persistent_vector();
+	test_task_pool();
+	test_moving_traced();
+	test_private();
+	test_parcel();
+	test_root_scope();
+	test_slab();
+	test_compact();
+	test_dispose();
+	test_recycle();
+
+	printf("%u failures\n", failures);
+	return failures;
 }
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include "gccoro.h"
+
+using namespace std;
+using namespace gcptr;
+
+// Coroutine test, built with C++20 (make testcoro). Smart pointers in the frame are members
+// of the frame block: they keep their objects alive across collections while the coroutine
+// is suspended, and are collected with the frame once nobody can resume it.
+
+unsigned failures;
+
+void check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if ( !ok )
+		failures++;
+}
+
+int live;
+
+struct X
+{
+	X(int v) : v(v) { live++; }
+	~X() { live--; v = -1; }
+	int v;
+	ptr<X> next;
+};
+
+// Builds a list in its frame, one node per resumption, and checks it after each suspension
+coroutine build(int n, bool &ok)
+{
+	ptr<X> head;
+	for ( int i = 0 ; i < n ; i++ )
+	{
+		ptr<X> x;
+		x.alloc(i);
+		x->next = head;
+		head = x;
+		co_await suspend_always();
+		int expect = i;
+		for ( ptr<X> p = head ; p ; p = p->next )
+			ok = ok && p->v == expect--;
+		ok = ok && expect == -1;
+	}
+}
+
+int main()
+{
+	bool ok = true;
+	{
+		coroutine c = build(50, ok);
+		c.resume();
+		for ( int i = 0 ; i < 50 ; i++ )
+		{
+			collect();
+			c.resume();
+		}
+		check(ok && c.done() && live == 50, "frame locals survive collections while suspended");
+	}
+	collect();
+	check(live == 0, "finished coroutine collected");
+
+	{
+		coroutine c = build(1000, ok);
+		atomic<bool> done(false);
+		thread t([&] { while ( !done ) collect(); });
+		for ( int i = 0 ; i < 300 ; i++ )
+			c.resume();
+		done = true;
+		t.join();
+		check(live == 300 && ok, "frame locals come and go while another thread collects");
+	}
+	collect();
+	check(live == 0, "abandoned coroutine collected");
+
+	printf("%u failures\n", failures);
+	return failures;
+}